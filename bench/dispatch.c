@@ -0,0 +1,67 @@
+/**
+ * Microbenchmark for the per-event cost of dispatching into a protection domain's entry points.
+ * It compares looking `notified` up with dlsym/dlerror on every event, which is what handler.c
+ * used to do, against calling through a pointer that was resolved once after dlopen.
+ *
+ * Usage: ./build/bench/dispatch [image.so] [iterations]
+ */
+
+#define _GNU_SOURCE
+
+#include <microkit.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_IMAGE "./build/bench/nop.so"
+#define DEFAULT_ITERATIONS 10000000UL
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : DEFAULT_IMAGE;
+    unsigned long iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_ITERATIONS;
+
+    void *handle = dlopen(path, RTLD_LAZY);
+    if (handle == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+
+    // Old behaviour: a symbol table lookup for every event
+    double start = now_ns();
+    for (unsigned long i = 0; i < iterations; i++) {
+        void (*notified)(microkit_channel) = (void (*)(microkit_channel)) dlsym(handle, "notified");
+        if (dlerror() != NULL) {
+            fprintf(stderr, "Error finding function \"notified\"\n");
+            return EXIT_FAILURE;
+        }
+        notified(i);
+    }
+    double lookup_ns = (now_ns() - start) / iterations;
+
+    // New behaviour: resolve once, then call through the dispatch table
+    void (*notified)(microkit_channel) = (void (*)(microkit_channel)) dlsym(handle, "notified");
+    if (notified == NULL) {
+        fprintf(stderr, "Error finding function \"notified\"\n");
+        return EXIT_FAILURE;
+    }
+    start = now_ns();
+    for (unsigned long i = 0; i < iterations; i++) {
+        notified(i);
+    }
+    double cached_ns = (now_ns() - start) / iterations;
+
+    printf("dispatch: %lu events through %s\n", iterations, path);
+    printf("  dlsym per event:  %8.2f ns/event\n", lookup_ns);
+    printf("  cached dispatch:  %8.2f ns/event\n", cached_ns);
+    printf("  saving:           %8.2f ns/event\n", lookup_ns - cached_ns);
+
+    dlclose(handle);
+    return EXIT_SUCCESS;
+}
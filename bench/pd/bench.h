@@ -0,0 +1,60 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmark protection domains. Every result is printed as one line of the
+ * form `BENCH {json}` with the same fields, which `bench/run.sh` collects into JSON and CSV. A
+ * domain prints `BENCH_DONE` once it has reported everything, so the harness knows when to stop.
+ */
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Reports one result. The samples are sorted in place.
+ * @param bench The name of the benchmark
+ * @param param What was varied, e.g. the number of message registers or bytes, or 0
+ * @param samples Latencies in nanoseconds, or NULL for a pure throughput result
+ * @param count The number of samples
+ * @param rate The throughput measured, in `unit`
+ * @param unit The unit of `rate`
+ */
+static inline void bench_report(const char *bench, uint64_t param, uint64_t *samples, size_t count,
+                                double rate, const char *unit) {
+    uint64_t total = 0, p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0;
+    if (samples != NULL && count > 0) {
+        qsort(samples, count, sizeof(uint64_t), bench_compare_u64);
+        for (size_t i = 0; i < count; i++) total += samples[i];
+        p50 = samples[count / 2];
+        p90 = samples[count * 90 / 100];
+        p99 = samples[count * 99 / 100];
+        p999 = samples[count * 999 / 1000];
+        max = samples[count - 1];
+    }
+
+    printf("BENCH {\"bench\":\"%s\",\"param\":%lu,\"samples\":%zu,\"mean_ns\":%lu,\"p50_ns\":%lu,"
+           "\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu,\"rate\":%.1f,\"unit\":\"%s\"}\n",
+           bench, param, samples != NULL ? count : 0, count > 0 && samples != NULL ? total / count : 0,
+           p50, p90, p99, p999, max, rate, unit);
+    fflush(stdout);
+}
+
+static inline void bench_done(void) {
+    printf("BENCH_DONE\n");
+    fflush(stdout);
+}
+
+#endif
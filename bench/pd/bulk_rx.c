@@ -0,0 +1,24 @@
+#include <microkit.h>
+#include <stdint.h>
+
+/*
+ * The receiving end of the `bulk_tx` benchmark. Reads every word of the block it is handed, so
+ * that the data actually moves, and replies with their sum.
+ */
+
+char *bulk;
+
+void init(void) {}
+
+void notified(microkit_channel ch) {}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    const uint64_t *words = (const uint64_t *) bulk;
+    uint64_t words_sent = microkit_mr_get(0) / sizeof(uint64_t);
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < words_sent; i++) {
+        sum += words[i];
+    }
+    microkit_mr_set(0, sum);
+    return microkit_msginfo_new(0, 1);
+}
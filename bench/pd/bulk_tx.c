@@ -0,0 +1,44 @@
+#include <microkit.h>
+#include <string.h>
+#include "bench.h"
+
+/*
+ * Shared memory bulk transfer. Copies a block into the shared region, then hands it to `bulk_rx`
+ * with a protected call, which reads all of it before replying. Reports the round trip of each
+ * block and the bandwidth for blocks of 4 KiB to 4 MiB.
+ */
+
+#define RX_CHANNEL_ID 1
+#define MAX_BLOCK (4 * 1024 * 1024)
+#define MEASURED_BYTES (256ull * 1024 * 1024)
+#define MAX_ROUNDS 20000
+
+char *bulk;
+
+static const uint64_t block_sizes[] = {4096, 65536, 1024 * 1024, MAX_BLOCK};
+static char source[MAX_BLOCK];
+static uint64_t samples[MAX_ROUNDS];
+
+void init(void) {
+    memset(source, 0x5a, sizeof(source));
+
+    for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+        uint64_t size = block_sizes[b];
+        uint64_t rounds = MEASURED_BYTES / size < MAX_ROUNDS ? MEASURED_BYTES / size : MAX_ROUNDS;
+
+        uint64_t begin = bench_now_ns();
+        for (uint64_t i = 0; i < rounds; i++) {
+            uint64_t start = bench_now_ns();
+            memcpy(bulk, source, size);
+            microkit_mr_set(0, size);
+            microkit_ppcall(RX_CHANNEL_ID, microkit_msginfo_new(0, 1));
+            samples[i] = bench_now_ns() - start;
+        }
+        double seconds = (bench_now_ns() - begin) / 1e9;
+
+        bench_report("bulk_transfer", size, samples, rounds, rounds * size / seconds / (1024 * 1024), "MiB/s");
+    }
+    bench_done();
+}
+
+void notified(microkit_channel ch) {}
@@ -0,0 +1,41 @@
+#include <microkit.h>
+#include "bench.h"
+
+/*
+ * Debug console cost: times whole lines written with the microkit_dbg_* calls in a tight loop,
+ * far faster than the loader drains them, so most of them end up dropped. The loader reports how
+ * many bytes were dropped when the system stops.
+ */
+
+#define WARMUP_LINES 1000
+#define MEASURED_LINES 20000
+
+static uint64_t samples[MEASURED_LINES];
+
+static void log_line(int i) {
+    microkit_dbg_puts("console benchmark line ");
+    microkit_dbg_put32(i);
+    microkit_dbg_puts(" of ");
+    microkit_dbg_put32(WARMUP_LINES + MEASURED_LINES);
+    microkit_dbg_putc('\n');
+}
+
+void init(void) {
+    for (int i = 0; i < WARMUP_LINES; i++) {
+        log_line(i);
+    }
+
+    uint64_t begin = bench_now_ns();
+    for (int i = 0; i < MEASURED_LINES; i++) {
+        uint64_t start = bench_now_ns();
+        log_line(WARMUP_LINES + i);
+        samples[i] = bench_now_ns() - start;
+    }
+    double seconds = (bench_now_ns() - begin) / 1e9;
+
+    bench_report("console_line", 0, samples, MEASURED_LINES, MEASURED_LINES / seconds, "lines/s");
+    bench_done();
+}
+
+void notified(microkit_channel ch) {
+}
@@ -0,0 +1,32 @@
+#include <microkit.h>
+#include "bench.h"
+
+/*
+ * One of several clients calling the same `ppc_server` at once. Each reports its own round trips;
+ * together they show how the server's event loop copes with fan-in.
+ */
+
+#define SERVER_CHANNEL_ID 1
+#define WARMUP_CALLS 1000
+#define MEASURED_CALLS 20000
+
+static uint64_t samples[MEASURED_CALLS];
+
+void init(void) {
+    for (int i = 0; i < WARMUP_CALLS; i++) {
+        microkit_ppcall(SERVER_CHANNEL_ID, microkit_msginfo_new(0, 0));
+    }
+
+    uint64_t begin = bench_now_ns();
+    for (int i = 0; i < MEASURED_CALLS; i++) {
+        uint64_t start = bench_now_ns();
+        microkit_ppcall(SERVER_CHANNEL_ID, microkit_msginfo_new(0, 0));
+        samples[i] = bench_now_ns() - start;
+    }
+    double seconds = (bench_now_ns() - begin) / 1e9;
+
+    bench_report("fanin_rtt", 0, samples, MEASURED_CALLS, MEASURED_CALLS / seconds, "calls/s");
+    bench_done();
+}
+
+void notified(microkit_channel ch) {}
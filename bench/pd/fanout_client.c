@@ -0,0 +1,79 @@
+#include <microkit.h>
+#include "bench.h"
+
+/*
+ * Calls NUM_SERVERS `slow_server`s per round and measures each round: one call after another with
+ * `microkit_ppcall`, all at once with `microkit_ppcall_async` and `microkit_ppcall_wait`, and all
+ * at once with the replies delivered to `replied` by the event loop.
+ */
+
+#define NUM_SERVERS 4
+#define FIRST_SERVER_CHANNEL_ID 1
+#define WARMUP_ROUNDS 100
+#define MEASURED_ROUNDS 2000
+
+static uint64_t samples[MEASURED_ROUNDS];
+static uint64_t begin, round_start;
+static int rounds, outstanding;
+
+static void sync_round(void) {
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        microkit_ppcall(FIRST_SERVER_CHANNEL_ID + i, microkit_msginfo_new(0, 1));
+    }
+}
+
+static void async_round(void) {
+    microkit_ticket tickets[NUM_SERVERS];
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        tickets[i] = microkit_ppcall_async(FIRST_SERVER_CHANNEL_ID + i, microkit_msginfo_new(0, 1));
+    }
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        microkit_ppcall_wait(tickets[i]);
+    }
+}
+
+static void measure(const char *bench, void (*round)(void)) {
+    for (int i = 0; i < WARMUP_ROUNDS; i++) round();
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < MEASURED_ROUNDS; i++) {
+        uint64_t round_begin = bench_now_ns();
+        round();
+        samples[i] = bench_now_ns() - round_begin;
+    }
+    double seconds = (bench_now_ns() - start) / 1e9;
+    bench_report(bench, NUM_SERVERS, samples, MEASURED_ROUNDS, MEASURED_ROUNDS / seconds, "rounds/s");
+}
+
+static void start_replied_round(void) {
+    round_start = bench_now_ns();
+    outstanding = NUM_SERVERS;
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        microkit_ppcall_async(FIRST_SERVER_CHANNEL_ID + i, microkit_msginfo_new(0, 1));
+    }
+}
+
+void init(void) {
+    microkit_mr_set(0, 42);
+    measure("fanout_sync", sync_round);
+    measure("fanout_async", async_round);
+
+    // The last variant runs from the event loop, one round per set of replies
+    begin = bench_now_ns();
+    start_replied_round();
+}
+
+void replied(microkit_channel ch, microkit_msginfo msginfo) {
+    if (--outstanding > 0) return;
+
+    samples[rounds++] = bench_now_ns() - round_start;
+    if (rounds < MEASURED_ROUNDS) {
+        start_replied_round();
+        return;
+    }
+    double seconds = (bench_now_ns() - begin) / 1e9;
+    bench_report("fanout_replied", NUM_SERVERS, samples, MEASURED_ROUNDS, MEASURED_ROUNDS / seconds, "rounds/s");
+    bench_done();
+}
+
+void notified(microkit_channel ch) {}
@@ -0,0 +1,3 @@
+/* `multicast_tx` notifying its subscribers through one notification group */
+#define MULTICAST_GROUP
+#include "multicast_tx.c"
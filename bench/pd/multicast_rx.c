@@ -0,0 +1,28 @@
+#include <microkit.h>
+#include <stdatomic.h>
+#include "bench.h"
+
+/*
+ * A subscriber of `multicast_tx`: folds the time it was notified into the first and last arrival
+ * of the round, then acknowledges the round on its first channel.
+ */
+
+#define ACK_CHANNEL_ID 1
+
+typedef struct {
+    _Atomic uint64_t first;
+    _Atomic uint64_t last;
+} arrivals_t;
+
+arrivals_t *arrivals;
+
+void notified(microkit_channel ch) {
+    uint64_t now = bench_now_ns();
+
+    uint64_t seen = atomic_load(&arrivals->first);
+    while (now < seen && !atomic_compare_exchange_weak(&arrivals->first, &seen, now)) {}
+    seen = atomic_load(&arrivals->last);
+    while (now > seen && !atomic_compare_exchange_weak(&arrivals->last, &seen, now)) {}
+
+    microkit_notify(ACK_CHANNEL_ID);
+}
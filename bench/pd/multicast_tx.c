@@ -0,0 +1,72 @@
+#include <microkit.h>
+#include <stdatomic.h>
+#include "bench.h"
+
+/*
+ * Multicast fan-out: each round notifies all NUM_SUBSCRIBERS `multicast_rx` domains, which stamp
+ * the first and last arrival of the round into the shared `arrivals` region and acknowledge it.
+ * Without MULTICAST_GROUP every subscriber is notified on its own channel; with it, one
+ * `microkit_notify_group` reaches them all. Reports how long after the round was sent its first
+ * and its last subscriber were notified.
+ */
+
+#define NUM_SUBSCRIBERS 32
+#define GROUP_ID 1
+#define WARMUP_ROUNDS 200
+#define MEASURED_ROUNDS 2000
+
+#ifdef MULTICAST_GROUP
+#define MULTICAST_BENCH "notify_group"
+#else
+#define MULTICAST_BENCH "notify_multicast"
+#endif
+
+typedef struct {
+    _Atomic uint64_t first;
+    _Atomic uint64_t last;
+} arrivals_t;
+
+arrivals_t *arrivals;
+
+static uint64_t first_samples[MEASURED_ROUNDS], last_samples[MEASURED_ROUNDS];
+static int round, acks;
+static uint64_t sent_at, begin;
+
+static void send_round(void) {
+    atomic_store(&arrivals->first, UINT64_MAX);
+    atomic_store(&arrivals->last, 0);
+    sent_at = bench_now_ns();
+#ifdef MULTICAST_GROUP
+    microkit_notify_group(GROUP_ID);
+#else
+    for (microkit_channel ch = 1; ch <= NUM_SUBSCRIBERS; ch++) {
+        microkit_notify(ch);
+    }
+#endif
+}
+
+void init(void) {
+    send_round();
+}
+
+void notified(microkit_channel ch) {
+    if (++acks < NUM_SUBSCRIBERS) return;
+    acks = 0;
+
+    uint64_t now = bench_now_ns();
+    if (round >= WARMUP_ROUNDS) {
+        first_samples[round - WARMUP_ROUNDS] = atomic_load(&arrivals->first) - sent_at;
+        last_samples[round - WARMUP_ROUNDS] = atomic_load(&arrivals->last) - sent_at;
+    } else if (round == WARMUP_ROUNDS - 1) {
+        begin = now;
+    }
+
+    if (++round == WARMUP_ROUNDS + MEASURED_ROUNDS) {
+        double rate = MEASURED_ROUNDS / ((now - begin) / 1e9);
+        bench_report(MULTICAST_BENCH "_first", NUM_SUBSCRIBERS, first_samples, MEASURED_ROUNDS, rate, "rounds/s");
+        bench_report(MULTICAST_BENCH "_last", NUM_SUBSCRIBERS, last_samples, MEASURED_ROUNDS, rate, "rounds/s");
+        bench_done();
+        return;
+    }
+    send_round();
+}
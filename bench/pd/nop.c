@@ -0,0 +1,14 @@
+#include <microkit.h>
+
+/*
+ * A protection domain whose entry points do nothing. Used to measure the cost of the runtime
+ * itself, without any user work on top of it.
+ */
+
+void init(void) {}
+
+void notified(microkit_channel ch) {}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    return msginfo;
+}
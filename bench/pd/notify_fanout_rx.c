@@ -0,0 +1,18 @@
+#include <microkit.h>
+
+/*
+ * Receives its share of the notifications of each `notify_fanout_tx` round, and acknowledges the
+ * round on its first channel once all of them have arrived.
+ */
+
+#define CHANNELS_PER_RECEIVER 4
+#define ACK_CHANNEL_ID 1
+
+static int received;
+
+void notified(microkit_channel ch) {
+    if (++received == CHANNELS_PER_RECEIVER) {
+        received = 0;
+        microkit_notify(ACK_CHANNEL_ID);
+    }
+}
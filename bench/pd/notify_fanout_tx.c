@@ -0,0 +1,52 @@
+#include <microkit.h>
+#include "bench.h"
+
+/*
+ * Notification fan-out: each round notifies all NUM_CHANNELS channels, spread evenly over the
+ * `notify_fanout_rx` domains, and ends once every one of them has acknowledged the round. Nothing
+ * here defers a notification; the systems decide that with `deferred_notify`.
+ */
+
+#define NUM_CHANNELS 8
+#define NUM_RECEIVERS 2
+#define WARMUP_ROUNDS 1000
+#define MEASURED_ROUNDS 20000
+
+#ifndef FANOUT_BENCH
+#define FANOUT_BENCH "notify_fanout"
+#endif
+
+static uint64_t samples[MEASURED_ROUNDS];
+static int round, acks;
+static uint64_t sent_at, begin;
+
+static void send_round(void) {
+    sent_at = bench_now_ns();
+    for (microkit_channel ch = 1; ch <= NUM_CHANNELS; ch++) {
+        microkit_notify(ch);
+    }
+}
+
+void init(void) {
+    send_round();
+}
+
+void notified(microkit_channel ch) {
+    if (++acks < NUM_RECEIVERS) return;
+    acks = 0;
+
+    uint64_t now = bench_now_ns();
+    if (round >= WARMUP_ROUNDS) {
+        samples[round - WARMUP_ROUNDS] = now - sent_at;
+    } else if (round == WARMUP_ROUNDS - 1) {
+        begin = now;
+    }
+
+    if (++round == WARMUP_ROUNDS + MEASURED_ROUNDS) {
+        double seconds = (now - begin) / 1e9;
+        bench_report(FANOUT_BENCH, NUM_CHANNELS, samples, MEASURED_ROUNDS, MEASURED_ROUNDS / seconds, "rounds/s");
+        bench_done();
+        return;
+    }
+    send_round();
+}
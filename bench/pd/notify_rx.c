@@ -0,0 +1,19 @@
+#include <microkit.h>
+
+/*
+ * The receiving end of the `notify_tx` benchmark. Counts its `notified` calls and replies to a
+ * protected call with the count.
+ */
+
+static uint64_t delivered;
+
+void init(void) {}
+
+void notified(microkit_channel ch) {
+    delivered++;
+}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    microkit_mr_set(0, delivered);
+    return microkit_msginfo_new(0, 1);
+}
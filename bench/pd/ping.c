@@ -0,0 +1,39 @@
+#include <microkit.h>
+#include "bench.h"
+
+/*
+ * Notification ping-pong with `pong`: each round is a notification to pong and pong's
+ * notification back.
+ */
+
+#define PONG_CHANNEL_ID 1
+#define WARMUP_ROUNDS 1000
+#define MEASURED_ROUNDS 20000
+
+static uint64_t samples[MEASURED_ROUNDS];
+static int round;
+static uint64_t sent_at, begin;
+
+void init(void) {
+    sent_at = bench_now_ns();
+    microkit_notify(PONG_CHANNEL_ID);
+}
+
+void notified(microkit_channel ch) {
+    uint64_t now = bench_now_ns();
+    if (round >= WARMUP_ROUNDS) {
+        samples[round - WARMUP_ROUNDS] = now - sent_at;
+    } else if (round == WARMUP_ROUNDS - 1) {
+        begin = now;
+    }
+
+    if (++round == WARMUP_ROUNDS + MEASURED_ROUNDS) {
+        double seconds = (now - begin) / 1e9;
+        bench_report("notify_pingpong", 0, samples, MEASURED_ROUNDS, MEASURED_ROUNDS / seconds, "rounds/s");
+        bench_done();
+        return;
+    }
+
+    sent_at = bench_now_ns();
+    microkit_notify(PONG_CHANNEL_ID);
+}
@@ -0,0 +1,13 @@
+#include <microkit.h>
+
+/*
+ * The other half of the `ping` benchmark: answers every notification with one of its own.
+ */
+
+#define PING_CHANNEL_ID 2
+
+void init(void) {}
+
+void notified(microkit_channel ch) {
+    microkit_notify(PING_CHANNEL_ID);
+}
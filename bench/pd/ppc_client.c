@@ -0,0 +1,41 @@
+#include <microkit.h>
+#include "bench.h"
+
+/*
+ * Measures protected procedure call round-trip latency against `ppc_server`, sending and receiving
+ * 0 to 64 message registers. The transport being measured is whatever the .system file selects
+ * for the channel.
+ */
+
+#define SERVER_CHANNEL_ID 1
+#define WARMUP_CALLS 1000
+#define MEASURED_CALLS 20000
+
+static const int register_counts[] = {0, 1, 2, 4, 8, 16, 32, 64};
+static uint64_t samples[MEASURED_CALLS];
+
+void init(void) {
+    for (size_t c = 0; c < sizeof(register_counts) / sizeof(register_counts[0]); c++) {
+        int count = register_counts[c];
+        for (int mr = 0; mr < count; mr++) {
+            microkit_mr_set(mr, mr);
+        }
+
+        for (int i = 0; i < WARMUP_CALLS; i++) {
+            microkit_ppcall(SERVER_CHANNEL_ID, microkit_msginfo_new(0, count));
+        }
+
+        uint64_t begin = bench_now_ns();
+        for (int i = 0; i < MEASURED_CALLS; i++) {
+            uint64_t start = bench_now_ns();
+            microkit_ppcall(SERVER_CHANNEL_ID, microkit_msginfo_new(0, count));
+            samples[i] = bench_now_ns() - start;
+        }
+        double seconds = (bench_now_ns() - begin) / 1e9;
+
+        bench_report("ppc_rtt", count, samples, MEASURED_CALLS, MEASURED_CALLS / seconds, "calls/s");
+    }
+    bench_done();
+}
+
+void notified(microkit_channel ch) {}
@@ -0,0 +1,14 @@
+#include <microkit.h>
+
+/*
+ * The callee of the protected procedure call benchmarks. Replies immediately with the message it
+ * was sent.
+ */
+
+void init(void) {}
+
+void notified(microkit_channel ch) {}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    return msginfo;
+}
@@ -0,0 +1,5 @@
+/* `queue_rx` as the consumer of an MPSC queue with three producers */
+#define QUEUE_TYPE MICROKIT_QUEUE_MPSC
+#define QUEUE_BENCH "queue_mpsc"
+#define NUM_PRODUCERS 3
+#include "queue_rx.c"
@@ -0,0 +1,3 @@
+/* `queue_tx` as one of the producers of an MPSC queue */
+#define QUEUE_TYPE MICROKIT_QUEUE_MPSC
+#include "queue_tx.c"
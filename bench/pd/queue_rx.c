@@ -0,0 +1,77 @@
+#include <microkit.h>
+#include <microkit_queue.h>
+#include "bench.h"
+
+/*
+ * Empties the queue `queue_tx` fills, BATCH at a time, checking that the entries of each of the
+ * NUM_PRODUCERS producers arrive exactly once and in order. Reports the throughput, the entries
+ * that were lost, duplicated or out of order, and how many `notified` calls it took.
+ */
+
+#ifndef QUEUE_TYPE
+#define QUEUE_TYPE MICROKIT_QUEUE_SPSC
+#define QUEUE_BENCH "queue_spsc"
+#endif
+#ifndef NUM_PRODUCERS
+#define NUM_PRODUCERS 1
+#endif
+
+#define PRODUCER_CHANNEL_ID 1
+#define QUEUE_REGION_SIZE 0x10000
+#define TOTAL_ENTRIES 4000000
+#define BATCH 64
+#define SEQUENCE_BITS 40
+
+char *queue_region;
+
+static microkit_queue_t queue;
+static uint64_t producer_tags[NUM_PRODUCERS], next_sequence[NUM_PRODUCERS];
+static uint64_t received, errors, notified_calls, begin;
+static int ready;
+
+static void check(uint64_t entry) {
+    uint64_t tag = entry >> SEQUENCE_BITS, sequence = entry & ((1ull << SEQUENCE_BITS) - 1);
+    for (int p = 0; p < NUM_PRODUCERS; p++) {
+        if (producer_tags[p] == 0) producer_tags[p] = tag;
+        if (producer_tags[p] != tag) continue;
+
+        errors += sequence != next_sequence[p];
+        next_sequence[p] = sequence + 1;
+        return;
+    }
+    errors++; // More producers than expected
+}
+
+void init(void) {
+    if (microkit_queue_init(&queue, queue_region, QUEUE_REGION_SIZE, sizeof(uint64_t), QUEUE_TYPE,
+                            PRODUCER_CHANNEL_ID) != 0) {
+        microkit_dbg_puts("queue_rx: the queue does not match\n");
+        return;
+    }
+    ready = 1;
+}
+
+void notified(microkit_channel ch) {
+    if (!ready) return;
+    notified_calls++;
+
+    uint64_t batch[BATCH];
+    uint32_t n;
+    do {
+        n = microkit_queue_dequeue(&queue, batch, BATCH);
+        if (received == 0 && n > 0) begin = bench_now_ns();
+        for (uint32_t i = 0; i < n; i++) check(batch[i]);
+        received += n;
+    } while (n == BATCH);
+
+    if (received >= (uint64_t) NUM_PRODUCERS * TOTAL_ENTRIES) {
+        double seconds = (bench_now_ns() - begin) / 1e9;
+        for (int p = 0; p < NUM_PRODUCERS; p++) errors += next_sequence[p] != TOTAL_ENTRIES;
+
+        bench_report(QUEUE_BENCH, BATCH, NULL, 0, received / seconds, "entries/s");
+        bench_report(QUEUE_BENCH "_errors", BATCH, NULL, 0, errors, "entries");
+        bench_report(QUEUE_BENCH "_notified", BATCH, NULL, 0, notified_calls, "calls");
+        bench_done();
+        ready = 0;
+    }
+}
@@ -0,0 +1,64 @@
+#include <microkit.h>
+#include <microkit_queue.h>
+#include <sched.h>
+#include <unistd.h>
+#include "bench.h"
+
+/*
+ * Streams TOTAL_ENTRIES sequence numbers through a queue to `queue_rx`, BATCH at a time. Every
+ * entry is tagged with the producer's pid, so that the consumer can check each producer's entries
+ * arrive complete and in order. A producer of an SPSC queue waits for `notified` when the queue is
+ * full; producers of an MPSC queue yield and retry.
+ */
+
+#ifndef QUEUE_TYPE
+#define QUEUE_TYPE MICROKIT_QUEUE_SPSC
+#endif
+
+#define CONSUMER_CHANNEL_ID 1
+#define QUEUE_REGION_SIZE 0x10000
+#define TOTAL_ENTRIES 4000000
+#define BATCH 32
+#define SEQUENCE_BITS 40
+
+char *queue_region;
+
+static microkit_queue_t queue;
+static uint64_t sent, tag;
+static int ready;
+
+static void produce(void) {
+    uint64_t batch[BATCH];
+    while (ready && sent < TOTAL_ENTRIES) {
+        uint32_t want = TOTAL_ENTRIES - sent < BATCH ? TOTAL_ENTRIES - sent : BATCH;
+        for (uint32_t i = 0; i < want; i++) {
+            batch[i] = tag | (sent + i);
+        }
+
+        uint32_t n = microkit_queue_enqueue(&queue, batch, want);
+        sent += n;
+        if (n < want) {
+            if (QUEUE_TYPE == MICROKIT_QUEUE_SPSC) return; // Notified once there is space
+            sched_yield();
+        }
+    }
+    if (ready && sent == TOTAL_ENTRIES) {
+        ready = 0;
+        bench_report("queue_producer_notifies", BATCH, NULL, 0, queue.notifications, "notifies");
+    }
+}
+
+void init(void) {
+    if (microkit_queue_init(&queue, queue_region, QUEUE_REGION_SIZE, sizeof(uint64_t), QUEUE_TYPE,
+                            CONSUMER_CHANNEL_ID) != 0) {
+        microkit_dbg_puts("queue_tx: the queue does not match\n");
+        return;
+    }
+    tag = (uint64_t) getpid() << SEQUENCE_BITS;
+    ready = 1;
+    produce();
+}
+
+void notified(microkit_channel ch) {
+    produce();
+}
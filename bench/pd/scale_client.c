@@ -0,0 +1,40 @@
+#include <microkit.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * A client of a generated clients-per-server topology (see `src/bin/scale.rs`). Calls its server
+ * on channel 0 for REPORT_AFTER_NS, then prints how many calls it made. A call answered with an
+ * error label fails the run, so that the error path is never measured as protected calls.
+ */
+
+#define SERVER_CHANNEL_ID 0
+#define REPORT_AFTER_NS 2000000000ull
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void init(void) {
+    printf("SCALE_READY %lu\n", clock_ns(CLOCK_REALTIME));
+    fflush(stdout);
+
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC), elapsed = 0, calls = 0;
+    while (elapsed < REPORT_AFTER_NS) {
+        microkit_msginfo reply = microkit_ppcall(SERVER_CHANNEL_ID, microkit_msginfo_new(0, 0));
+        if (microkit_msginfo_get_label(reply) != seL4_NoError) {
+            printf("SCALE_ERROR call %lu answered with label %lu\n", calls, microkit_msginfo_get_label(reply));
+            fflush(stdout);
+            return;
+        }
+        calls++;
+        elapsed = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    }
+    printf("SCALE_DONE %lu %.1f\n", calls, calls / (elapsed / 1e9));
+    fflush(stdout);
+}
+
+void notified(microkit_channel ch) {}
@@ -0,0 +1,54 @@
+#include <microkit.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * A node of a generated topology (see `src/bin/scale.rs`). Every channel carries a notification
+ * ping-pong: the node starts one on each of the NUM_INITIATED channels it initiates (ids 0 to
+ * NUM_INITIATED - 1) and answers every notification on any channel with one of its own. Once
+ * REPORT_AFTER_NS have passed it prints how many notifications it handled. In the clients
+ * topology, nodes without initiated channels serve the calls of `scale_client` instead.
+ */
+
+#ifndef NUM_INITIATED
+#define NUM_INITIATED 0
+#endif
+
+#define REPORT_AFTER_NS 2000000000ull
+
+static uint64_t start_ns, events;
+static int reported;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void init(void) {
+    start_ns = clock_ns(CLOCK_MONOTONIC);
+    // The harness measures startup against the wall clock it launched the loader at
+    printf("SCALE_READY %lu\n", clock_ns(CLOCK_REALTIME));
+    fflush(stdout);
+
+    for (microkit_channel ch = 0; ch < NUM_INITIATED; ch++) {
+        microkit_notify(ch);
+    }
+}
+
+void notified(microkit_channel ch) {
+    events++;
+    microkit_notify(ch);
+
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    if (!reported && elapsed >= REPORT_AFTER_NS) {
+        reported = 1;
+        printf("SCALE_DONE %lu %.1f\n", events, events / (elapsed / 1e9));
+        fflush(stdout);
+    }
+}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    return microkit_msginfo_new(0, 0);
+}
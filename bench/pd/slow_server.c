@@ -0,0 +1,19 @@
+#include <microkit.h>
+#include <time.h>
+
+/*
+ * The callee of the fan-out benchmark. Waits SERVICE_NS before replying, as a server waiting on a
+ * device would, and echoes the message it was sent.
+ */
+
+#define SERVICE_NS 50000
+
+void init(void) {}
+
+void notified(microkit_channel ch) {}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    const struct timespec service = {.tv_sec = 0, .tv_nsec = SERVICE_NS};
+    nanosleep(&service, NULL);
+    return msginfo;
+}
@@ -0,0 +1,45 @@
+#include <microkit.h>
+#include <unistd.h>
+#include "bench.h"
+
+/*
+ * One of many clients calling `stress_server` at once to check that concurrent calls never see
+ * each other's message registers. Every call carries a pattern unique to this client and call,
+ * which the server checks and transforms, and the reply is checked again here. Reports its round
+ * trips and how many calls came back corrupted.
+ */
+
+#define SERVER_CHANNEL_ID 1
+#define STRESS_CALLS 5000
+#define STRESS_REGISTERS 16
+
+static uint64_t samples[STRESS_CALLS];
+
+void init(void) {
+    uint64_t corrupted = 0;
+    uint64_t seed = (uint64_t) getpid() << 32;
+
+    uint64_t begin = bench_now_ns();
+    for (uint64_t call = 0; call < STRESS_CALLS; call++) {
+        for (int mr = 0; mr < STRESS_REGISTERS; mr++) {
+            microkit_mr_set(mr, seed + call * STRESS_REGISTERS + mr);
+        }
+
+        uint64_t start = bench_now_ns();
+        microkit_msginfo reply = microkit_ppcall(SERVER_CHANNEL_ID, microkit_msginfo_new(0, STRESS_REGISTERS));
+        samples[call] = bench_now_ns() - start;
+
+        int ok = microkit_msginfo_get_label(reply) == 0 && microkit_msginfo_get_count(reply) == STRESS_REGISTERS;
+        for (int mr = 0; ok && mr < STRESS_REGISTERS; mr++) {
+            ok = microkit_mr_get(mr) == ~(seed + call * STRESS_REGISTERS + mr);
+        }
+        corrupted += !ok;
+    }
+    double seconds = (bench_now_ns() - begin) / 1e9;
+
+    bench_report("stress_rtt", STRESS_REGISTERS, samples, STRESS_CALLS, STRESS_CALLS / seconds, "calls/s");
+    bench_report("stress_corrupted", STRESS_REGISTERS, NULL, 0, corrupted, "calls");
+    bench_done();
+}
+
+void notified(microkit_channel ch) {}
@@ -0,0 +1,3 @@
+/* `stress_server` answering every call through a nested call over a shared IPC buffer */
+#define STRESS_NESTED
+#include "stress_server.c"
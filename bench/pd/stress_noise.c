@@ -0,0 +1,16 @@
+#include <microkit.h>
+
+/*
+ * Keeps a `stress_noisy_server` busy in `notified` for as long as the system runs, by answering
+ * each of its notifications with another.
+ */
+
+#define SERVER_CHANNEL_ID 1
+
+void init(void) {
+    microkit_notify(SERVER_CHANNEL_ID);
+}
+
+void notified(microkit_channel ch) {
+    microkit_notify(SERVER_CHANNEL_ID);
+}
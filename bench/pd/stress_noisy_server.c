@@ -0,0 +1,3 @@
+/* `stress_server` overwriting its registers in `notified` between calls */
+#define STRESS_NOISY
+#include "stress_server.c"
@@ -0,0 +1,48 @@
+#include <microkit.h>
+#include <sched.h>
+
+/*
+ * The callee of the concurrent call stress test. Checks that the registers of each call follow on
+ * from one another, as `stress_client` sets them, and replies with every register inverted. A call
+ * whose registers were mixed up with another call's is answered with seL4_InvalidArgument.
+ *
+ * With STRESS_NOISY, every notification overwrites the registers before it is answered, to check
+ * that registers set outside `protected` never reach a caller. With STRESS_NESTED, the registers
+ * are inverted by a nested call to another `stress_server` over a shared IPC buffer, to check that
+ * the reply still reaches the caller after the registers moved into that buffer.
+ */
+
+#define NOISE_REGISTERS 16
+#define BACKEND_CHANNEL_ID 62
+
+void init(void) {}
+
+void notified(microkit_channel ch) {
+#ifdef STRESS_NOISY
+    for (seL4_Word mr = 0; mr < NOISE_REGISTERS; mr++) {
+        microkit_mr_set(mr, 0xbad0000000000000ull | mr);
+    }
+    microkit_notify(ch);
+#endif
+}
+
+microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo) {
+    seL4_Word count = microkit_msginfo_get_count(msginfo);
+    seL4_Word first = microkit_mr_get(0);
+    for (seL4_Word mr = 0; mr < count; mr++) {
+        if (microkit_mr_get(mr) != first + mr) {
+            return microkit_msginfo_new(seL4_InvalidArgument, 0);
+        }
+    }
+
+#ifdef STRESS_NESTED
+    return microkit_ppcall(BACKEND_CHANNEL_ID, msginfo);
+#endif
+
+    // Yield half way through to give other calls every chance to interfere
+    for (seL4_Word mr = 0; mr < count; mr++) {
+        microkit_mr_set(mr, ~microkit_mr_get(mr));
+        if (mr == count / 2) sched_yield();
+    }
+    return msginfo;
+}
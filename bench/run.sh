@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Runs the benchmark systems through the loader and collects the `BENCH {json}` lines their
+# protection domains print into build/bench/results.json and build/bench/results.csv. Each system
+# is stopped once all of its reporting domains have printed BENCH_DONE.
+#
+# Usage: ./bench/run.sh [system ...]   (run from the repository root; default: the whole suite)
+
+LOADER=${LOADER:-./linux_microkit}
+OUT_DIR=./build/bench
+TIMEOUT=${BENCH_TIMEOUT:-120}
+
+# Each benchmark system, with the number of domains in it that report results
+SUITE="ppc_pipe:1 ppc_futex:1 ppc_shared:1 ppc_uring:1 ppc_uring_sqpoll:1 notify_pingpong:1 notify_poll:1 notify_uring:1 notify_throughput:1 notify_throughput_uring:1 notify_fanout:1 notify_fanout_deferred:1 notify_multicast:1 notify_group:1 fanin:4 fanout:1 ppc_stress:12 ppc_stress_entry:8 bulk:1 queue_spsc:1 queue_mpsc:1 console:1"
+
+FIELDS="system,bench,param,samples,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,rate,unit"
+
+mkdir -p "$OUT_DIR"
+results="$OUT_DIR/results.jsonl"
+: > "$results"
+
+reporters_of() {
+    for entry in $SUITE; do
+        [ "${entry%%:*}" = "$1" ] && echo "${entry#*:}" && return
+    done
+    echo 1
+}
+
+if [ $# -eq 0 ]; then
+    set -- $(for entry in $SUITE; do echo "${entry%%:*}"; done)
+fi
+
+for system in "$@"; do
+    reporters=$(reporters_of "$system")
+    log="$OUT_DIR/$system.log"
+    echo "Running $system" >&2
+
+    "$LOADER" "bench/$system.system" > "$log" 2>&1 &
+    loader_pid=$!
+
+    waited=0
+    while kill -0 "$loader_pid" 2> /dev/null; do
+        [ "$(grep -c '^BENCH_DONE' "$log")" -ge "$reporters" ] && break
+        if [ "$waited" -ge $((TIMEOUT * 10)) ]; then
+            echo "$system timed out after $TIMEOUT s, see $log" >&2
+            break
+        fi
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    kill -TERM "$loader_pid" 2> /dev/null
+    wait "$loader_pid"
+
+    grep '^BENCH {' "$log" | sed "s/^BENCH {/{\"system\":\"$system\",/" >> "$results"
+done
+
+{
+    echo "["
+    sed '$!s/$/,/' "$results"
+    echo "]"
+} > "$OUT_DIR/results.json"
+
+{
+    echo "$FIELDS"
+    sed 's/"[a-z0-9_]*"://g; s/[{}"]//g' "$results"
+} > "$OUT_DIR/results.csv"
+
+rm "$results"
+echo "Results written to $OUT_DIR/results.json and $OUT_DIR/results.csv" >&2
+column -s, -t < "$OUT_DIR/results.csv" 2> /dev/null || cat "$OUT_DIR/results.csv"
@@ -1,58 +1,552 @@
 #pragma once
 
 #include <microkit.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "khash.h"
 
 #define PAGE_SIZE 4096
+#define LARGE_PAGE_SIZE 0x200000
+#define HUGE_PAGE_SIZE 0x40000000
 #define MICROKIT_MAX_PDS 63
 #define IPC_BUFFER_SIZE 64
 #define PIPE_READ_FD 0
 #define PIPE_WRITE_FD 1
+#define CACHE_LINE_SIZE 64
+
+/* How long a server parks in the fused reply-and-wait step before going back to epoll */
+#define PPC_REPLY_WAIT_NS 1000000
+
+/* seL4 Microkit priorities run from 0 to 254; PDs without one keep the default Linux policy */
+#define MICROKIT_MAX_PRIORITY 254
+#define PRIORITY_UNSET -1
+
+/* seL4 Microkit budgets and periods are in microseconds; a budget below its period is enforced */
+#define DEFAULT_BUDGET_US 1000
+#define BUDGET_MONITOR_MIN_SLEEP_NS 50000
+#define BUDGET_MONITOR_MAX_SLEEP_NS 10000000
+
+/* Event loop batching: epoll events per wait, pipe calls per read, and pipe calls per wakeup by default */
+#define EPOLL_MAX_EVENTS 16
+#define PPC_READ_BATCH 32
+#define TRACE_RING_EVENTS 65536 // A power of two
+#define CONSOLE_RING_BYTES 65536 // A power of two
+#define CONSOLE_LINE_MAX 1024 // Longer lines are split, each part keeping the line's timestamp
+
+#define HISTOGRAM_SUB_BITS 4 // 16 linear buckets per power of two, so values are kept to within 6.25%
+#define HISTOGRAM_MAX_BITS 40 // Latencies of 2^40 ns (about 18 minutes) and over share the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Build with -DMICROKIT_TRACE=0 to compile tracing out entirely
+#ifndef MICROKIT_TRACE
+#define MICROKIT_TRACE 1
+#endif
+
+#define DEFAULT_DRAIN_BUDGET 64
+
+// Build with -DMICROKIT_IO_URING=0 to leave the io_uring event loop out, e.g. for kernels older than 6.7
+#ifndef MICROKIT_IO_URING
+#define MICROKIT_IO_URING 1
+#endif
+
+/* The io_uring event loop: ring entries, buffers for its multishot reads, and how long an SQPOLL thread stays awake */
+#define URING_ENTRIES 64
+#define URING_BUFFERS 16 // A power of two
+#define URING_SQPOLL_IDLE_MS 10
+
+/* Busy polling: the shortest spin the adaptive window shrinks to, and the outcomes it adapts over */
+#define POLL_MIN_WINDOW_NS 1000
+#define POLL_HISTORY 16 // Spins remembered, at most 32
+#define POLL_GROW_HITS 12 // Double the window when at least this many of them found work
+#define POLL_SHRINK_HITS 4 // Halve it when at most this many did
+#define POLL_CLOCK_SPINS 32 // Spins between looks at the clock
+
+/* How the event loop of a protection domain waits for and collects its events */
+enum event_loop {
+    EVENT_LOOP_EPOLL,
+    EVENT_LOOP_IO_URING,
+    EVENT_LOOP_IO_URING_SQPOLL, // With a kernel thread taking the submissions
+};
+
+/* What the completions of the io_uring event loop are for */
+enum uring_event {
+    URING_NOTIFICATION,
+    URING_PIPE_CALLS,
+    URING_DOORBELL,
+    URING_REPLY_WRITTEN, // Plus the reply slot written from, so it must stay last
+};
+
+/* Transports a protected procedure call can take across a channel */
+#define PPC_TRANSPORT_PIPE 0
+#define PPC_TRANSPORT_FUTEX 1
 
 typedef struct process process_t;
 typedef struct shared_memory_stack shared_memory_stack_t;
 typedef struct shared_memory shared_memory_t;
 typedef struct message message_t;
+typedef struct entry_points entry_points_t;
+typedef struct channel channel_t;
+typedef struct ppc_slot ppc_slot_t;
+typedef struct pd_control pd_control_t;
+typedef struct pd_stats pd_stats_t;
+typedef struct budget budget_t;
+typedef struct trace_event trace_event_t;
+typedef struct trace_ring trace_ring_t;
+typedef struct console_ring console_ring_t;
+typedef struct histogram histogram_t;
+typedef struct latency_stats latency_stats_t;
+typedef struct uring uring_t;
+typedef struct notification_group notification_group_t;
+typedef struct group_member group_member_t;
 
 /**
  * Some of the fields within these structs are not owned by the C implementation, but rather by the Rust.
  * These fields are prefixed with an underscore to indicate that they should not be freed.
  */
 
-KHASH_MAP_INIT_INT(channel, process_t *)
+KHASH_MAP_INIT_INT(channel, channel_t *)
+
+/* States of a futex call slot. The caller owns the slot in IDLE and REPLY, the receiver in CALL. */
+enum ppc_slot_state {
+    PPC_SLOT_IDLE,
+    PPC_SLOT_CALL,
+    PPC_SLOT_REPLY,
+};
+
+/* Where a protection domain is currently blocked, so that posters know how to wake it */
+enum pd_wait_state {
+    PD_RUNNING,
+    PD_WAIT_EPOLL,
+    PD_WAIT_FUTEX,
+};
+
+/**
+ * A single outstanding protected procedure call on a futex channel. The caller fills in the call
+ * and waits on `state` until the receiver has written the reply into `msginfo`. The reply to an
+ * asynchronous call is posted to the caller's control block instead.
+ */
+struct ppc_slot {
+    _Atomic uint32_t state;
+    uint32_t async;
+    microkit_channel ch;
+    microkit_msginfo msginfo;
+    process_t *caller; // The process that calls through this slot
+    microkit_channel caller_ch; // The id the caller knows the channel by
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Event loop counters. Only ever written by the owning domain; the loader reads them at exit. */
+struct pd_stats {
+    uint64_t wakeups;
+    uint64_t notifications;
+    uint64_t ppcs;
+    uint64_t wakeup_events; // Events handled since the most recent wakeup
+    uint64_t max_wakeup_events;
+    uint64_t budget_exhausted; // Wakeups that left calls in the pipe because the drain budget ran out
+    uint64_t deadline_overruns; // SIGXCPUs from SCHED_DEADLINE for running past the CPU budget
+    uint64_t poll_hits; // Busy polls that found work before their window ran out
+    uint64_t poll_sleeps; // Busy polls that ran out and went to sleep in epoll
+    uint64_t poll_spin_ns; // Time spent busy polling
+    uint64_t poll_window_ns; // The current busy poll window
+    uint64_t syscalls; // System calls the event loop made to wait for, collect and answer events
+    uint64_t notifications_sent;
+    uint64_t notifications_deferred; // Those of the notifications sent that went out when the entry point returned
+    uint64_t notify_writes; // Writes to receivers' eventfds that the notifications sent took
+};
+
+/* When a domain reached each step of its startup, in CLOCK_MONOTONIC nanoseconds, or 0 until it does */
+typedef struct {
+    uint64_t started_ns; // The child began running
+    uint64_t loaded_ns; // Its image was opened, its variables set and its entry points found
+    uint64_t init_ns; // Its init was called, once its memory was prefaulted
+    uint64_t ready_ns; // Its init returned
+} pd_startup_t;
+
+/**
+ * The part of a protection domain that its peers need to touch directly. It lives in MAP_SHARED
+ * memory, so it is the same object in every process after clone.
+ */
+struct pd_control {
+    _Atomic uint32_t wait_state;
+    _Atomic uint32_t event_seq; // Futex word, bumped by anyone who posts work to this domain
+    _Atomic uint32_t epoll_pending; // Set by posters whose work only shows up through epoll
+    _Atomic uint64_t notifications; // One bit per pending notification, indexed by our channel id
+    _Atomic uint64_t notify_sent[MICROKIT_MAX_PDS]; // When each pending notification was first sent, if measured
+    _Atomic uint64_t replied; // One bit per asynchronous call whose reply is waiting, indexed by our channel id
+    microkit_msginfo replies[MICROKIT_MAX_PDS]; // The replies to those calls
+    ppc_slot_t slots[MICROKIT_MAX_PDS]; // Call slots of the futex channels this domain receives on
+    pd_stats_t stats;
+    pd_startup_t startup;
+};
+
+/* How the CPU budget of a process is enforced */
+enum budget_enforcement {
+    BUDGET_NONE,
+    BUDGET_DEADLINE, // The kernel throttles the child under SCHED_DEADLINE
+    BUDGET_MONITOR,  // The loader samples the child's CPU time and stops it with SIGSTOP
+};
+
+/* A CPU budget per period, and the loader-side bookkeeping used when it has to enforce it itself */
+struct budget {
+    uint64_t budget_ns;
+    uint64_t period_ns;
+    int enforcement;
+    clockid_t cpu_clock;
+    uint64_t period_start;
+    uint64_t period_cpu_start;
+    uint64_t throttled_since; // 0 while the child is allowed to run
+    uint64_t overruns;
+    uint64_t throttled_ns;
+};
+
+/* Kinds of trace events. Each *_BEGIN is followed by the matching *_END on the same domain. */
+enum trace_event_type {
+    TRACE_INIT_BEGIN,
+    TRACE_INIT_END,
+    TRACE_NOTIFIED_BEGIN,
+    TRACE_NOTIFIED_END,
+    TRACE_PROTECTED_BEGIN,
+    TRACE_PROTECTED_END,
+    TRACE_PPCALL_BEGIN,
+    TRACE_PPCALL_END,
+    TRACE_NOTIFY, // A notification sent, instantaneous
+    TRACE_WAKEUP, // The event loop woke up, instantaneous
+    TRACE_PPCALL_ASYNC, // An asynchronous call made, instantaneous
+    TRACE_REPLY, // The reply to an asynchronous call taken, instantaneous
+    TRACE_REPLIED_BEGIN,
+    TRACE_REPLIED_END,
+    TRACE_NOTIFY_GROUP, // A notification group notified, instantaneous, with the group id as its channel
+};
+
+struct trace_event {
+    uint64_t timestamp; // CLOCK_MONOTONIC in nanoseconds
+    uint32_t type;
+    uint32_t ch;
+};
+
+/**
+ * A single-writer, single-reader ring of trace events in shared memory. The domain advances `head`
+ * after writing an event and the loader advances `tail` after reading one. Events that do not fit
+ * are dropped rather than blocking the domain, but a *_BEGIN is only written if there is room for
+ * its *_END as well, so that the slices in the trace always nest.
+ */
+struct trace_ring {
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint64_t dropped; // Only written by the domain
+    uint64_t reserved; // Slots held for the *_END of each written *_BEGIN, only used by the domain
+    uint64_t written; // Bit n is set if the open *_BEGIN at depth n was written, only used by the domain
+    uint32_t depth; // *_BEGIN events without their *_END yet, only used by the domain
+    trace_event_t events[TRACE_RING_EVENTS];
+};
+
+/**
+ * A single-writer, single-reader ring of debug console output in shared memory, laid out like a
+ * trace ring but holding bytes. Each line starts with the CLOCK_MONOTONIC time of its first byte,
+ * so the loader can stamp it however late it drains it. Output that does not fit is dropped whole
+ * rather than blocking the domain.
+ */
+struct console_ring {
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint64_t dropped; // Bytes dropped, only written by the domain
+    int line_open; // Whether the domain is part way through a line, only used by the domain
+    char data[CONSOLE_RING_BYTES];
+};
+
+/**
+ * A log-linear latency histogram in the style of HdrHistogram. Values below 2^HISTOGRAM_SUB_BITS
+ * get a bucket each; above that, every power of two is split into 2^HISTOGRAM_SUB_BITS buckets.
+ * Only one process writes to a histogram, so recording is a plain increment.
+ */
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/* The latency histograms of a process, in the loader's stats region. Channels that do not exist have none. */
+struct latency_stats {
+    histogram_t *ppc[MICROKIT_MAX_PDS]; // Round trips of the calls made on each channel
+    histogram_t *notify[MICROKIT_MAX_PDS]; // Send to `notified` of each channel we are notified on
+};
+
+/* One end of a channel, as seen by the process that sends on it */
+struct channel {
+    process_t *receiver;
+    microkit_channel peer_ch; // The id the receiver knows this channel by
+    ppc_slot_t *slot; // NULL when protected calls go over the receiver's pipes
+    seL4_Word *ipc_buffer; // The receiver's IPC buffer for calls across this channel
+    int shared_ipc_buffer; // Whether callers set and read their message registers in ipc_buffer in place
+};
+
+/* A member of a notification group, with the bits of every id it knows the group by */
+struct group_member {
+    process_t *receiver;
+    uint64_t bits;
+};
+
+/* The domains one domain notifies together with microkit_notify_group, gathered at load time */
+struct notification_group {
+    int num_members;
+    group_member_t *members;
+};
+
+/**
+ * The entry points of a protection domain, resolved once after the image is opened so that the
+ * event loop never has to look a symbol up on the hot path. Any of these may be NULL.
+ */
+struct entry_points {
+    void (*init)(void);
+    void (*notified)(microkit_channel ch);
+    microkit_msginfo (*protected)(microkit_channel ch, microkit_msginfo msginfo);
+    void (*replied)(microkit_channel ch, microkit_msginfo msginfo);
+};
 
 struct process {
     char *_path;
+    void *image; // The image as the loader preloaded it, or NULL for the child to open it itself
 
     char *stack_top;
     char *sig_handler_stack;
     shared_memory_stack_t *shared_memory;
 
     khash_t(channel) *channel_id_to_process;
-    pid_t notification; // fd for receiving notifications
+    pid_t notification; // eventfd rung when our notification word goes from empty to non-empty
     pid_t send_pipe[2]; // Send pipe for PPC
     pid_t receive_pipe[2]; // Receive pipe for PPC
 
     seL4_Word *ipc_buffer;
+    seL4_Word *mrs; // The message registers in use: ipc_buffer, or an IPC buffer of a call
+    seL4_Word *call_buffers; // IPC_BUFFER_SIZE words for the calls arriving on each of our channel ids
+
+    entry_points_t entry; // Dispatch table filled in by the child after dlopen
+
+    pd_control_t *control;
+    int ppc_doorbell; // eventfd rung by futex callers while this domain sleeps in epoll
+    int num_fast_slots;
+
+    unsigned int drain_budget; // Most pipe calls served per wakeup before other sources get a turn
+    uint64_t poll_ns; // Longest the event loop busy polls before it blocks, or 0 to always block
+    uint32_t poll_history; // Whether each of the latest busy polls found work, newest in bit 0
+    int event_loop; // EVENT_LOOP_*
+    int defer_notify; // Whether microkit_notify defers every notification
+    uint64_t deferred_notify; // Channels with a deferred notification, by our channel id
+    notification_group_t *groups[MICROKIT_MAX_PDS]; // The groups we notify, by group id, or NULL
+    uint64_t group_ids; // The ids groups notify us on, which no channel of ours may use
+    int priority; // seL4 Microkit priority, or PRIORITY_UNSET
+    pid_t pid;
+
+    budget_t budget;
+
+    cpu_set_t *affinity; // CPUs the child may run on, or NULL to leave it unpinned
+    size_t affinity_size;
+
+    char *name;
+    trace_ring_t *trace; // NULL unless tracing is enabled
+    console_ring_t *console; // Where the debug console writes to, or NULL to write to stdout
+    latency_stats_t *latency; // NULL unless latency histograms are enabled
+    uint32_t stack_size;
+    int memory_policy; // MEMORY_* flags for the stacks, IPC buffer and control block
+
+    uint64_t async_calls; // Channels with an asynchronous call outstanding, by our channel id
+    uint64_t async_start_ns[MICROKIT_MAX_PDS]; // When each of those calls was made, if measured
 };
 
 struct shared_memory_stack {
     shared_memory_t *shm;
-    const char *_varname;
+    const char *_varname; // NULL when the map has no setvar_vaddr
     shared_memory_stack_t *next;
+    void *vaddr; // Where the process wants the region, or NULL for anywhere
+    int prot;
+    void *mapped; // Where the region ended up in the process, once it has been mapped
+};
+
+/* Whether a mapping is populated before the domain's first message, and kept resident with mlock */
+enum memory_policy {
+    MEMORY_PREFAULT = 1 << 0,
+    MEMORY_LOCK     = 1 << 1,
+};
+
+/* What a shared memory region ended up being backed by */
+enum shared_memory_backing {
+    BACKING_SMALL_PAGES,
+    BACKING_HUGETLB,     // Pages reserved in hugetlbfs
+    BACKING_TRANSPARENT, // Aligned and advised for transparent huge pages
 };
 
 struct shared_memory {
-    void *shared_buffer;
+    void *shared_buffer; // The loader's own view of the region
     unsigned long size;
+    unsigned long page_size; // Page size asked for in the .system file
+    int backing;
+    int memory_policy; // MEMORY_* flags, also applied by every domain that maps the region
+    int fd; // memfd holding the region, mapped separately by every domain
 };
 
 struct message {
     microkit_channel ch;
     microkit_msginfo msginfo;
-    pid_t send_back;
+    pid_t send_back; // The caller's reply pipe, or -1 to post the reply of an asynchronous call
+    process_t *caller;
+    microkit_channel caller_ch; // The id the caller knows the channel by
 };
 
 int event_handler(void *arg);
+int populate_memory(void *addr, size_t len, int policy);
+void *map_shared_memory(shared_memory_t *shm, void *vaddr, int prot);
+void post_reply(process_t *caller, microkit_channel caller_ch, microkit_msginfo reply);
+microkit_msginfo take_reply(microkit_channel ch);
+void flush_deferred_notifications(void);
+void console_process(process_t *process);
+void read_console(process_t *process);
+void release_preloaded_images(process_t *process);
+void start_loader_thread(pthread_t *thread, void *(*body)(void *), const char *name);
+
+#if MICROKIT_IO_URING
+#include <linux/io_uring.h>
+
+uring_t *uring_create(process_t *process, int sqpoll);
+void uring_read_multishot(uring_t *ring, int fd, uint64_t event);
+void uring_write_reply(uring_t *ring, int fd, microkit_msginfo reply);
+void uring_submit(uring_t *ring);
+int uring_enter(uring_t *ring, int wait);
+int uring_next(uring_t *ring, struct io_uring_cqe *cqe);
+void *uring_buffer(uring_t *ring, const struct io_uring_cqe *cqe);
+void uring_release(uring_t *ring, const struct io_uring_cqe *cqe);
+#endif
+
+static inline uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Adds a latency to a histogram.
+ * @param histogram The histogram, or NULL to drop the value
+ * @param ns The latency in nanoseconds
+ */
+static inline void histogram_record(histogram_t *histogram, uint64_t ns) {
+    if (histogram == NULL) return;
+
+    uint64_t bucket = ns;
+    if (ns >= (1ULL << HISTOGRAM_SUB_BITS)) {
+        int exponent = 63 - __builtin_clzll(ns);
+        if (exponent >= HISTOGRAM_MAX_BITS) {
+            bucket = HISTOGRAM_BUCKETS - 1;
+        } else {
+            uint64_t sub_bucket = (ns >> (exponent - HISTOGRAM_SUB_BITS)) & ((1ULL << HISTOGRAM_SUB_BITS) - 1);
+            bucket = ((uint64_t) (exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+        }
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    if (ns > histogram->max) histogram->max = ns;
+}
+
+/**
+ * Appends an event to a trace ring, dropping it if the loader has fallen too far behind. A *_BEGIN
+ * needs a free slot for itself and one for its *_END, and its *_END is dropped exactly when it is.
+ * @param ring The ring of the current process
+ * @param type A trace_event_type
+ * @param ch The channel the event is about, or 0
+ */
+static inline void trace_record(trace_ring_t *ring, uint32_t type, microkit_channel ch) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t free = TRACE_RING_EVENTS - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+
+    switch (type) {
+    case TRACE_INIT_BEGIN:
+    case TRACE_NOTIFIED_BEGIN:
+    case TRACE_PROTECTED_BEGIN:
+    case TRACE_PPCALL_BEGIN:
+    case TRACE_REPLIED_BEGIN: {
+        uint32_t depth = ring->depth++;
+        if (depth >= 64) {
+            ring->dropped++;
+            return;
+        }
+        if (free < ring->reserved + 2) {
+            ring->written &= ~(1ULL << depth);
+            ring->dropped++;
+            return;
+        }
+        ring->written |= 1ULL << depth;
+        ring->reserved++;
+        break;
+    }
+    case TRACE_INIT_END:
+    case TRACE_NOTIFIED_END:
+    case TRACE_PROTECTED_END:
+    case TRACE_PPCALL_END:
+    case TRACE_REPLIED_END: {
+        uint32_t depth = ring->depth > 0 ? --ring->depth : 64;
+        if (depth >= 64 || !(ring->written & (1ULL << depth))) {
+            ring->dropped++;
+            return;
+        }
+        // The slot was held for this event when its *_BEGIN was written
+        ring->reserved--;
+        break;
+    }
+    default:
+        if (free <= ring->reserved) {
+            ring->dropped++;
+            return;
+        }
+    }
+
+    trace_event_t *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->timestamp = monotonic_ns();
+    event->type = type;
+    event->ch = ch;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Records a trace event if tracing is enabled. Disabled, this is a single well predicted branch. */
+static inline void trace(process_t *process, uint32_t type, microkit_channel ch) {
+#if MICROKIT_TRACE
+    if (__builtin_expect(process->trace != NULL, 0)) {
+        trace_record(process->trace, type, ch);
+    }
+#endif
+}
+
+/* Tells the CPU we are spinning, so it can save power and give way to a sibling hyperthread */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static inline long futex_wait(_Atomic uint32_t *addr, uint32_t expected, const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static inline long futex_wake(_Atomic uint32_t *addr, int count) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/**
+ * Tells a receiver that work has been posted for it through its eventfd or pipes. A receiver parked
+ * in the fused reply-and-wait step of the futex transport, or waiting for a reply, is woken so it
+ * looks again.
+ * @param receiver The process work was posted to
+ */
+static inline void wake_receiver(process_t *receiver) {
+    pd_control_t *control = receiver->control;
+    atomic_store(&control->epoll_pending, 1);
+    atomic_fetch_add(&control->event_seq, 1);
+    if (atomic_load(&control->wait_state) == PD_WAIT_FUTEX) {
+        futex_wake(&control->event_seq, 1);
+    }
+}
@@ -12,11 +12,33 @@ typedef uint64_t seL4_Error;
 typedef struct {
     unsigned long words[1];
 } microkit_msginfo;
+typedef seL4_Word microkit_ticket;
 
-/* User provided functions */
+/* Error codes, numbered as in libsel4 */
+enum {
+    seL4_NoError = 0,
+    seL4_InvalidArgument,
+    seL4_InvalidCapability,
+    seL4_IllegalOperation,
+    seL4_RangeError,
+    seL4_AlignmentError,
+    seL4_FailedLookup,
+    seL4_TruncatedMessage,
+    seL4_DeleteFirst,
+    seL4_RevokeFirst,
+    seL4_NotEnoughMemory,
+};
+
+/*
+ * User provided functions. All of them are optional: a protection domain without `notified`
+ * ignores notifications, and a protected call into one without `protected` is answered with
+ * a reply whose label is seL4_InvalidCapability. `replied` is given the replies to asynchronous
+ * calls; without it they wait for `microkit_ppcall_wait` or `microkit_ppcall_poll`.
+ */
 void init(void);
 void notified(microkit_channel ch);
 microkit_msginfo protected(microkit_channel ch, microkit_msginfo msginfo);
+void replied(microkit_channel ch, microkit_msginfo msginfo);
 
 /*
  * Output a single character on the debug console.
@@ -53,6 +75,19 @@ static inline void microkit_internal_crash(seL4_Error err) {
 /* Microkit API */
 void microkit_notify(microkit_channel ch);
 
+/*
+ * Notifies a channel once the current entry point returns, or before the next protected call.
+ * Deferring on a channel again before then has no further effect, and the deferred notifications
+ * to one receiver reach it together.
+ */
+void microkit_deferred_notify(microkit_channel ch);
+
+/*
+ * Notifies every member of a notification group the protection domain sends to, as declared by a
+ * <notification_group> of the .system file. Each member is notified on the id it knows the group by.
+ */
+void microkit_notify_group(microkit_channel group);
+
 microkit_msginfo microkit_msginfo_new(seL4_Word label, seL4_Uint16 count);
 
 seL4_Word microkit_msginfo_get_label(microkit_msginfo msginfo);
@@ -63,4 +98,14 @@ void microkit_mr_set(seL4_Uint8 mr, seL4_Word value);
 
 seL4_Word microkit_mr_get(seL4_Uint8 mr);
 
-microkit_msginfo microkit_ppcall(microkit_channel ch, microkit_msginfo msginfo);
\ No newline at end of file
+microkit_msginfo microkit_ppcall(microkit_channel ch, microkit_msginfo msginfo);
+
+/*
+ * Asynchronous protected procedure calls. Each channel can have one call outstanding, and calls on
+ * different channels proceed at once. A reply's message registers are in place once it is taken.
+ */
+microkit_ticket microkit_ppcall_async(microkit_channel ch, microkit_msginfo msginfo);
+
+microkit_msginfo microkit_ppcall_wait(microkit_ticket ticket);
+
+int microkit_ppcall_poll(microkit_ticket ticket, microkit_msginfo *reply);
\ No newline at end of file
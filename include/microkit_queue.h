@@ -0,0 +1,61 @@
+#pragma once
+
+#include <microkit.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock-free queues of fixed size entries, laid out inside a memory region that both ends map.
+ * A single producer queue (SPSC) is filled by one protection domain; a multi-producer queue (MPSC)
+ * by any number of them. Either way one protection domain empties it.
+ *
+ * Each end signals the other with `microkit_notify`, but only when the other end has said it is
+ * waiting, so a stream that keeps both ends busy makes no system calls at all:
+ *
+ *  - `microkit_queue_dequeue` returning fewer entries than asked for means the queue is empty, and
+ *    that the consumer will be notified once the next entry is enqueued. A consumer therefore
+ *    dequeues until it gets a short count, and then waits for `notified`.
+ *  - `microkit_queue_enqueue` on an SPSC queue returning fewer entries than asked for means the
+ *    queue is full, and that the producer will be notified once there is space again. Producers of
+ *    an MPSC queue are not notified of space and retry instead.
+ */
+
+enum microkit_queue_type {
+    MICROKIT_QUEUE_SPSC = 1,
+    MICROKIT_QUEUE_MPSC = 2,
+};
+
+/* The layout of a queue in its memory region, defined in queue.c */
+typedef struct microkit_queue_shared microkit_queue_shared_t;
+
+/* One end's handle on a queue. Lives in the protection domain's own memory. */
+typedef struct {
+    microkit_queue_shared_t *shared;
+    microkit_channel ch; // The channel this end notifies the other end on
+    uint64_t cached; // The other end's index as last seen, so that it is only read when needed
+    uint64_t notifications; // How many times this end has notified the other
+} microkit_queue_t;
+
+/*
+ * Sets up a queue in `region` holding as many entries of `entry_size` bytes as fit, rounded down
+ * to a power of two, or attaches to it if the other end got there first. Both ends must pass the
+ * same region size, entry size and type. Returns 0, or -1 if they do not match or nothing fits.
+ */
+int microkit_queue_init(microkit_queue_t *queue, void *region, size_t region_size, uint32_t entry_size,
+                        int type, microkit_channel ch);
+
+/*
+ * Copies up to `count` entries into the queue and returns how many fit.
+ */
+uint32_t microkit_queue_enqueue(microkit_queue_t *queue, const void *entries, uint32_t count);
+
+/*
+ * Copies up to `max` entries out of the queue, oldest first, and returns how many there were.
+ * Only one protection domain may dequeue from a queue.
+ */
+uint32_t microkit_queue_dequeue(microkit_queue_t *queue, void *entries, uint32_t max);
+
+/*
+ * The number of entries the queue holds when full.
+ */
+uint32_t microkit_queue_capacity(microkit_queue_t *queue);
@@ -0,0 +1,390 @@
+//! Generates systems of parameterised size and shape, and runs them through the loader to see how
+//! the runtime scales with the number of protection domains.
+//!
+//!     scale generate <topology> <pds> [options]
+//!     scale run <topology> <pds>[,<pds>...] [options]
+//!
+//! Topologies:
+//!     chain       each domain linked to the next
+//!     tree        each domain linked to `--fanout` children (default 2)
+//!     all-to-all  every domain linked to every other
+//!     clients     `--clients` clients (default 4) calling each server
+//!
+//! Options:
+//!     --region-size HEX   give every link a shared region of this size, mapped by both ends
+//!     --fanout N          children per domain in a tree
+//!     --clients N         clients per server
+//!     --timeout S         how long a run may take before it counts as broken (default 60)
+//!     --preload-images B  whether the loader opens every image before cloning (true|false, default false)
+//!
+//! Links between domains carry notification ping-pongs (`bench/pd/scale_node.c`), or protected
+//! calls for the clients topology (`bench/pd/scale_client.c`, served by `scale_node.c`); a call
+//! answered with an error fails the run. Generated systems and images go to build/scale/, and
+//! `run` appends a row per size to build/scale/results.csv with the startup time, steady-state
+//! event rate, memory and file descriptors used. Run from the repository root
+//! after `make all`, or point `LOADER` at another build of the loader.
+
+use std::collections::BTreeSet;
+use std::error::Error;
+use std::fmt::Write as _;
+use std::fs;
+use std::io::Write as _;
+use std::path::Path;
+use std::process::{Child, Command, Stdio};
+use std::thread::sleep;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+const OUT_DIR: &str = "./build/scale";
+// Must match MICROKIT_MAX_PDS in include/handler.h, which also bounds channel ids
+const MICROKIT_MAX_PDS: usize = 63;
+// Each domain holds two eventfds and two pipes in the loader, and every child inherits all of them
+const FDS_PER_PD: usize = 6;
+const STACK_SIZE: u32 = 0x4000;
+
+struct Options {
+    region_size: u64,
+    fanout: usize,
+    clients: usize,
+    timeout: Duration,
+    preload_images: bool,
+}
+
+/// A generated system: which domains initiate which links, and what each domain runs.
+struct Topology {
+    name: String,
+    pds: usize,
+    links: Vec<(usize, usize)>, // (initiator, other end)
+    clients: BTreeSet<usize>, // Domains that call instead of ping-ponging
+}
+
+impl Topology {
+    fn build(name: &str, pds: usize, options: &Options) -> Result<Self, Box<dyn Error>> {
+        if pds < 2 {
+            return Err("A topology needs at least 2 protection domains".into());
+        }
+
+        let mut links = Vec::new();
+        let mut clients = BTreeSet::new();
+        match name {
+            "chain" => links.extend((1..pds).map(|i| (i - 1, i))),
+            "tree" => links.extend((1..pds).map(|i| ((i - 1) / options.fanout, i))),
+            "all-to-all" => {
+                for i in 0..pds {
+                    links.extend((i + 1..pds).map(|j| (i, j)));
+                }
+            }
+            "clients" => {
+                // Every group is one server followed by its clients
+                let group = options.clients + 1;
+                for i in 0..pds {
+                    if i % group != 0 {
+                        links.push((i, i - i % group));
+                        clients.insert(i);
+                    }
+                }
+            }
+            other => return Err(format!("Unknown topology '{}'", other).into()),
+        }
+        Ok(Topology { name: name.to_string(), pds, links, clients })
+    }
+
+    fn pd_name(&self, pd: usize) -> String {
+        if self.clients.contains(&pd) { format!("client{}", pd) } else { format!("pd{}", pd) }
+    }
+
+    /// The links each domain initiates come first, so that they get channel ids 0 to k - 1.
+    fn channel_ids(&self) -> Vec<Vec<usize>> {
+        let mut initiated = vec![0; self.pds];
+        for &(from, _) in &self.links {
+            initiated[from] += 1;
+        }
+
+        let mut next_initiated = vec![0; self.pds];
+        let mut next_passive = initiated.clone();
+        let mut ids = Vec::new();
+        for &(from, to) in &self.links {
+            ids.push(vec![next_initiated[from], next_passive[to]]);
+            next_initiated[from] += 1;
+            next_passive[to] += 1;
+        }
+        ids
+    }
+
+    fn initiated(&self, pd: usize) -> usize {
+        self.links.iter().filter(|(from, _)| *from == pd).count()
+    }
+
+    fn max_channels(&self) -> usize {
+        (0..self.pds).map(|pd| self.links.iter().filter(|(a, b)| *a == pd || *b == pd).count()).max().unwrap_or(0)
+    }
+
+    fn image(&self, pd: usize) -> String {
+        if self.clients.contains(&pd) {
+            "scale/scale_client.elf".to_string()
+        } else {
+            format!("scale/scale_node_{}.elf", self.initiated(pd))
+        }
+    }
+
+    fn system_path(&self) -> String {
+        format!("{}/{}_{}.system", OUT_DIR, self.name, self.pds)
+    }
+
+    /// Writes the .system file and builds every image it refers to.
+    fn generate(&self, options: &Options) -> Result<(), Box<dyn Error>> {
+        fs::create_dir_all(OUT_DIR)?;
+
+        let mut xml = String::from("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+        writeln!(xml, "<!-- Generated by `scale generate {} {}` -->", self.name, self.pds)?;
+        writeln!(xml, "<system{}>", if options.preload_images { " preload_images=\"true\"" } else { "" })?;
+        if options.region_size > 0 {
+            for link in 0..self.links.len() {
+                writeln!(xml, "    <memory_region name=\"link{}\" size=\"{:#x}\"/>", link, options.region_size)?;
+            }
+        }
+
+        for pd in 0..self.pds {
+            writeln!(xml, "    <protection_domain name=\"{}\" stack_size=\"{:#x}\">", self.pd_name(pd), STACK_SIZE)?;
+            writeln!(xml, "        <program_image path=\"{}\"/>", self.image(pd))?;
+            if options.region_size > 0 {
+                for (link, _) in self.links.iter().enumerate().filter(|(_, (a, b))| *a == pd || *b == pd) {
+                    writeln!(xml, "        <map mr=\"link{}\" perms=\"rw\"/>", link)?;
+                }
+            }
+            writeln!(xml, "    </protection_domain>")?;
+        }
+
+        for (&(from, to), ids) in self.links.iter().zip(self.channel_ids()) {
+            let ppc = if self.clients.contains(&from) { " ppc=\"futex\"" } else { "" };
+            writeln!(xml, "    <channel{}>", ppc)?;
+            writeln!(xml, "        <end pd=\"{}\" id=\"{}\" pp=\"true\"/>", self.pd_name(from), ids[0])?;
+            writeln!(xml, "        <end pd=\"{}\" id=\"{}\"/>", self.pd_name(to), ids[1])?;
+            writeln!(xml, "    </channel>")?;
+        }
+        xml.push_str("</system>\n");
+        fs::write(self.system_path(), xml)?;
+
+        let mut built = BTreeSet::new();
+        for pd in 0..self.pds {
+            let image = self.image(pd);
+            if built.insert(image.clone()) {
+                let initiated = if self.clients.contains(&pd) { None } else { Some(self.initiated(pd)) };
+                build_image(&image, initiated)?;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Compiles a node or client image with the flags the Makefile uses for protection domains.
+fn build_image(image: &str, initiated: Option<usize>) -> Result<(), Box<dyn Error>> {
+    let output = format!("./build/{}.so", image.trim_end_matches(".elf"));
+    let mut cc = Command::new("gcc");
+    cc.args(["-I./include", "-shared", "-fPIC", "-O2", "-Wno-unused-result", "-o", &output]);
+    match initiated {
+        Some(count) => { cc.arg(format!("-DNUM_INITIATED={}", count)).arg("./bench/pd/scale_node.c"); }
+        None => { cc.arg("./bench/pd/scale_client.c"); }
+    }
+    cc.args(["-L./build", "-lmicrokit", "-Wl,-rpath,./build"]);
+
+    if !cc.status()?.success() {
+        return Err(format!("Failed to build {}", output).into());
+    }
+    Ok(())
+}
+
+/// The limits a system of this size runs into, worked out before it is run.
+fn predicted_limits(topology: &Topology) -> Vec<String> {
+    let mut limits = Vec::new();
+    if topology.pds > MICROKIT_MAX_PDS {
+        limits.push(format!("{} PDs exceeds MICROKIT_MAX_PDS ({}), which seL4 Microkit enforces but this runtime does not",
+                            topology.pds, MICROKIT_MAX_PDS));
+    }
+    if topology.max_channels() > MICROKIT_MAX_PDS {
+        limits.push(format!("a PD needs {} channel ids, but ids must be below {}", topology.max_channels(), MICROKIT_MAX_PDS));
+    }
+
+    let mut nofile = libc::rlimit { rlim_cur: 0, rlim_max: 0 };
+    unsafe { libc::getrlimit(libc::RLIMIT_NOFILE, &mut nofile); }
+    let fds = FDS_PER_PD * topology.pds + 16;
+    if fds as u64 > nofile.rlim_cur {
+        limits.push(format!("needs about {} fds in the loader and in every PD, over RLIMIT_NOFILE ({})", fds, nofile.rlim_cur));
+    }
+    limits
+}
+
+/// Every process the loader has cloned, found through /proc.
+fn children_of(pid: u32) -> Vec<u32> {
+    fs::read_to_string(format!("/proc/{}/task/{}/children", pid, pid))
+        .map(|list| list.split_whitespace().filter_map(|child| child.parse().ok()).collect())
+        .unwrap_or_default()
+}
+
+/// A field of /proc/<pid>/status or smaps_rollup, in KiB.
+fn proc_kib(pid: u32, file: &str, field: &str) -> u64 {
+    fs::read_to_string(format!("/proc/{}/{}", pid, file)).ok()
+        .and_then(|text| text.lines().find(|line| line.starts_with(field))
+            .and_then(|line| line.split_whitespace().nth(1)?.parse().ok()))
+        .unwrap_or(0)
+}
+
+fn open_fds(pid: u32) -> u64 {
+    fs::read_dir(format!("/proc/{}/fd", pid)).map(|dir| dir.count() as u64).unwrap_or(0)
+}
+
+struct Measurement {
+    status: String,
+    startup_ms: f64,
+    events: u64,
+    rate: f64,
+    rss_kib: u64,
+    pss_kib: u64,
+    loader_fds: u64,
+    total_fds: u64,
+}
+
+/// Runs a generated system until every domain has reported, sampling its resources on the way.
+fn measure(topology: &Topology, options: &Options) -> Result<Measurement, Box<dyn Error>> {
+    let log_path = format!("{}/{}_{}.log", OUT_DIR, topology.name, topology.pds);
+    let log = fs::File::create(&log_path)?;
+    let launched_ns = SystemTime::now().duration_since(UNIX_EPOCH)?.as_nanos() as u64;
+    let loader_path = std::env::var("LOADER").unwrap_or_else(|_| "./linux_microkit".to_string());
+    let mut loader: Child = Command::new(loader_path).arg(topology.system_path())
+        .stdout(log.try_clone()?).stderr(log).stdin(Stdio::null()).spawn()?;
+
+    let reporters = if topology.clients.is_empty() { topology.pds } else { topology.clients.len() };
+    let started = Instant::now();
+    let mut measurement = Measurement {
+        status: "ok".to_string(), startup_ms: 0.0, events: 0, rate: 0.0,
+        rss_kib: 0, pss_kib: 0, loader_fds: 0, total_fds: 0,
+    };
+
+    loop {
+        sleep(Duration::from_millis(100));
+        let output = fs::read_to_string(&log_path).unwrap_or_default();
+        let ready: Vec<u64> = output.lines().filter_map(|line| line.strip_prefix("SCALE_READY ")?.parse().ok()).collect();
+        let done: Vec<(u64, f64)> = output.lines().filter_map(|line| {
+            let mut fields = line.strip_prefix("SCALE_DONE ")?.split_whitespace();
+            Some((fields.next()?.parse().ok()?, fields.next()?.parse().ok()?))
+        }).collect();
+
+        if let Some(error) = output.lines().find_map(|line| line.strip_prefix("SCALE_ERROR ")) {
+            measurement.status = format!("a client failed: {}", error);
+            break;
+        }
+        if let Some(status) = loader.try_wait()? {
+            let error = output.lines().filter(|line| !line.starts_with("SCALE_")).last()
+                .unwrap_or("no error message").to_string();
+            measurement.status = format!("loader exited ({}): {}", status, error);
+            return Ok(measurement);
+        }
+
+        // Take the resources once everything is up, while the system is in its steady state
+        if ready.len() == topology.pds && measurement.total_fds == 0 {
+            measurement.startup_ms = (ready.iter().max().unwrap() - launched_ns) as f64 / 1e6;
+            let pid = loader.id();
+            measurement.loader_fds = open_fds(pid);
+            measurement.total_fds = measurement.loader_fds;
+            measurement.rss_kib = proc_kib(pid, "status", "VmRSS:");
+            measurement.pss_kib = proc_kib(pid, "smaps_rollup", "Pss:");
+            for child in children_of(pid) {
+                measurement.total_fds += open_fds(child);
+                measurement.rss_kib += proc_kib(child, "status", "VmRSS:");
+                measurement.pss_kib += proc_kib(child, "smaps_rollup", "Pss:");
+            }
+        }
+
+        if done.len() >= reporters {
+            measurement.events = done.iter().map(|(events, _)| events).sum();
+            measurement.rate = done.iter().map(|(_, rate)| rate).sum();
+            break;
+        }
+        if started.elapsed() > options.timeout {
+            measurement.status = format!("timed out with {}/{} PDs started and {}/{} reported, see {}",
+                                         ready.len(), topology.pds, done.len(), reporters, log_path);
+            break;
+        }
+    }
+
+    unsafe { libc::kill(loader.id() as libc::pid_t, libc::SIGTERM); }
+    loader.wait()?;
+    Ok(measurement)
+}
+
+fn run(topology_name: &str, sizes: &[usize], options: &Options) -> Result<(), Box<dyn Error>> {
+    let results_path = format!("{}/results.csv", OUT_DIR);
+    fs::create_dir_all(OUT_DIR)?;
+    let new_file = !Path::new(&results_path).exists();
+    let mut results = fs::OpenOptions::new().create(true).append(true).open(&results_path)?;
+    if new_file {
+        writeln!(results, "topology,pds,links,status,startup_ms,events,events_per_s,rss_kib,pss_kib,loader_fds,total_fds")?;
+    }
+
+    println!("{:>10} {:>5} {:>6} {:>11} {:>13} {:>10} {:>10} {:>10}  status",
+             "topology", "pds", "links", "startup ms", "events/s", "pss KiB", "loader fds", "total fds");
+    for &pds in sizes {
+        let topology = Topology::build(topology_name, pds, options)?;
+        topology.generate(options)?;
+        for limit in predicted_limits(&topology) {
+            println!("{:>10} {:>5}  expect trouble: {}", topology.name, pds, limit);
+        }
+
+        let m = measure(&topology, options)?;
+        println!("{:>10} {:>5} {:>6} {:>11.1} {:>13.0} {:>10} {:>10} {:>10}  {}",
+                 topology.name, pds, topology.links.len(), m.startup_ms, m.rate, m.pss_kib, m.loader_fds, m.total_fds, m.status);
+        writeln!(results, "{},{},{},\"{}\",{:.1},{},{:.1},{},{},{},{}", topology.name, pds, topology.links.len(),
+                 m.status.replace('"', "'"), m.startup_ms, m.events, m.rate, m.rss_kib, m.pss_kib, m.loader_fds, m.total_fds)?;
+
+        if m.status != "ok" {
+            println!("{} breaks at {} PDs: {}", topology.name, pds, m.status);
+            break;
+        }
+    }
+    println!("Results appended to {}", results_path);
+    Ok(())
+}
+
+fn parse_options(args: &[String]) -> Result<Options, Box<dyn Error>> {
+    let mut options = Options {
+        region_size: 0, fanout: 2, clients: 4, timeout: Duration::from_secs(60), preload_images: false,
+    };
+    let mut args = args.iter();
+    while let Some(flag) = args.next() {
+        let value = args.next().ok_or_else(|| format!("Missing value for {}", flag))?;
+        match flag.as_str() {
+            "--region-size" => options.region_size = u64::from_str_radix(value.trim_start_matches("0x"), 16)?,
+            "--fanout" => options.fanout = value.parse()?,
+            "--clients" => options.clients = value.parse()?,
+            "--timeout" => options.timeout = Duration::from_secs(value.parse()?),
+            "--preload-images" => options.preload_images = value.parse()?,
+            other => return Err(format!("Unknown option {}", other).into()),
+        }
+    }
+    if options.fanout == 0 || options.clients == 0 {
+        return Err("--fanout and --clients must be at least 1".into());
+    }
+    Ok(options)
+}
+
+fn main() -> Result<(), Box<dyn Error>> {
+    let args: Vec<String> = std::env::args().collect();
+    if args.len() < 4 {
+        eprintln!("Usage: {} generate|run <chain|tree|all-to-all|clients> <pds>[,<pds>...] [options]", args[0]);
+        std::process::exit(1);
+    }
+
+    let options = parse_options(&args[4..])?;
+    let sizes = args[3].split(',').map(str::parse).collect::<Result<Vec<usize>, _>>()?;
+    match args[1].as_str() {
+        "generate" => {
+            for pds in sizes {
+                let topology = Topology::build(&args[2], pds, &options)?;
+                topology.generate(&options)?;
+                println!("Generated {}", topology.system_path());
+            }
+            Ok(())
+        }
+        "run" => run(&args[2], &sizes, &options),
+        other => Err(format!("Unknown command '{}'", other).into()),
+    }
+}
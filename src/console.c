@@ -0,0 +1,153 @@
+/**
+ * The loader's side of the debug console. Every protection domain writes its debug output into its
+ * own ring in shared memory; a thread in the loader drains the rings and writes whole lines to
+ * stdout, each prefixed with when it was begun and which domain wrote it. Lines from different
+ * domains therefore never interleave, and a domain never waits on stdout.
+ */
+
+#define _GNU_SOURCE
+
+#include <handler.h>
+#include <sys/mman.h>
+#include <string.h>
+
+#define CONSOLE_DRAIN_INTERVAL_NS 10000000
+
+/* The loader's progress through the ring of one process */
+typedef struct {
+    process_t *process;
+    int in_line; // Whether the timestamp of the current line has been read
+    uint64_t line_ns;
+    size_t line_len;
+    char line[CONSOLE_LINE_MAX];
+} console_reader_t;
+
+static console_reader_t *readers = NULL;
+static int num_readers = 0;
+static uint64_t console_start_ns;
+static pthread_t console_writer_thread;
+static atomic_int console_writer_running = 0;
+
+/**
+ * Gives a process a console ring, so that its debug output is buffered from the moment it starts.
+ * 
+ * @param process Handle to the process
+ */
+void console_process(process_t *process) {
+    process->console = mmap(NULL, sizeof(console_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (process->console == MAP_FAILED) {
+        fprintf(stderr, "Error on creating the console ring of %s\n", process->name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Has the console writer drain the ring of a process. Called on the loader thread just before the
+ * process is cloned, so only processes that run are read, and the list is never grown concurrently.
+ * 
+ * @param process Handle to the process
+ */
+void read_console(process_t *process) {
+    if (num_readers == 0) {
+        console_start_ns = monotonic_ns();
+    }
+
+    console_reader_t *grown = realloc(readers, (num_readers + 1) * sizeof(console_reader_t));
+    if (grown == NULL) {
+        fprintf(stderr, "Error on allocating the list of console readers\n");
+        exit(EXIT_FAILURE);
+    }
+    readers = grown;
+    readers[num_readers++] = (console_reader_t){.process = process};
+}
+
+/**
+ * Writes out the line a reader has gathered, prefixed with its timestamp and domain.
+ * 
+ * @param reader The reader of a process
+ */
+static void emit_line(console_reader_t *reader) {
+    double seconds = (double) (int64_t) (reader->line_ns - console_start_ns) / 1e9;
+    fprintf(stdout, "[%12.6f] %s: %.*s\n", seconds, reader->process->name, (int) reader->line_len, reader->line);
+    reader->line_len = 0;
+}
+
+/**
+ * Reads what a process has written since the last drain, writes out the lines it completed and
+ * hands their bytes back.
+ * 
+ * @param reader The reader of a process
+ */
+static void drain_console_ring(console_reader_t *reader) {
+    console_ring_t *ring = reader->process->console;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head) {
+        // A line's timestamp is always published together with its first byte
+        if (!reader->in_line) {
+            for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+                ((char *) &reader->line_ns)[i] = ring->data[tail++ & (CONSOLE_RING_BYTES - 1)];
+            }
+            reader->in_line = 1;
+        }
+
+        char c = ring->data[tail++ & (CONSOLE_RING_BYTES - 1)];
+        if (c == '\n') {
+            emit_line(reader);
+            reader->in_line = 0;
+        } else {
+            reader->line[reader->line_len++] = c;
+            if (reader->line_len == CONSOLE_LINE_MAX) emit_line(reader);
+        }
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+/**
+ * Drains every console ring in turn until stopped, writing each round out at once.
+ */
+static void *console_writer(void *arg) {
+    const struct timespec interval = {.tv_sec = 0, .tv_nsec = CONSOLE_DRAIN_INTERVAL_NS};
+
+    while (atomic_load(&console_writer_running)) {
+        for (int i = 0; i < num_readers; ++i) {
+            drain_console_ring(&readers[i]);
+        }
+        fflush(stdout);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Starts draining the console rings. Called once every process is running.
+ */
+void start_console_writer(void) {
+    if (num_readers == 0 || atomic_exchange(&console_writer_running, 1)) return;
+
+    start_loader_thread(&console_writer_thread, console_writer, "console writer");
+}
+
+/**
+ * Stops the console writer, drains what is left in the rings, including lines the processes did
+ * not finish, and reports the output each of them dropped. Called once the processes have stopped.
+ */
+void stop_console_writer(void) {
+    if (atomic_exchange(&console_writer_running, 0)) {
+        pthread_join(console_writer_thread, NULL);
+    }
+
+    for (int i = 0; i < num_readers; ++i) {
+        console_reader_t *reader = &readers[i];
+        drain_console_ring(reader);
+        if (reader->line_len > 0) emit_line(reader);
+        reader->in_line = 0;
+
+        if (reader->process->console->dropped > 0) {
+            printf("%s: console dropped %lu bytes, its ring of %d bytes was full\n", reader->process->name,
+                   reader->process->console->dropped, CONSOLE_RING_BYTES);
+        }
+    }
+    fflush(stdout);
+}
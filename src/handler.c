@@ -10,21 +10,93 @@
 #include <handler.h>
 #include <dlfcn.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <signal.h>
 #include <execinfo.h>
+#include <errno.h>
+#include <string.h>
 
 // The current process. Useful to keep track of to avoid a worst-case O(p) search in microkit.c.
 process_t *proc;
 
+// Every shared memory region the loader created, defined in loader.c
+extern shared_memory_t **shared_memory_regions;
+extern int num_shared_memory_regions;
+
+/**
+ * Maps a shared memory region. Without an address the mapping is aligned to the region's page size,
+ * or to 2 MiB for regions that want transparent huge pages, so that those can actually be used.
+ * @param shm The shared memory region
+ * @param vaddr The address to map it at, or NULL for anywhere. An existing mapping there is an error.
+ * @param prot The PROT_* protections of the mapping
+ * @return The mapped address, or MAP_FAILED
+ */
+void *map_shared_memory(shared_memory_t *shm, void *vaddr, int prot) {
+    uint64_t alignment = shm->backing == BACKING_TRANSPARENT ? LARGE_PAGE_SIZE : shm->page_size;
+    char *addr = vaddr;
+
+    if (vaddr == NULL && alignment > PAGE_SIZE) {
+        // Reserve enough address space to find an aligned start, then map over it
+        char *raw = mmap(NULL, shm->size + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) return MAP_FAILED;
+        addr = (char *) (((uintptr_t) raw + alignment - 1) & ~(uintptr_t) (alignment - 1));
+        if (addr > raw) munmap(raw, addr - raw);
+        munmap(addr + shm->size, raw + alignment - addr);
+        if (mmap(addr, shm->size, prot, MAP_SHARED | MAP_FIXED, shm->fd, 0) == MAP_FAILED) {
+            munmap(addr, shm->size);
+            return MAP_FAILED;
+        }
+    } else {
+        int flags = MAP_SHARED | (vaddr != NULL ? MAP_FIXED_NOREPLACE : 0);
+        addr = mmap(vaddr, shm->size, prot, flags, shm->fd, 0);
+        if (addr == MAP_FAILED) return MAP_FAILED;
+        // Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint
+        if (vaddr != NULL && addr != vaddr) {
+            munmap(addr, shm->size);
+            errno = EEXIST;
+            return MAP_FAILED;
+        }
+    }
+
+    if (shm->backing == BACKING_TRANSPARENT) madvise(addr, shm->size, MADV_HUGEPAGE);
+    return addr;
+}
+
+/**
+ * Replaces the loader's views of the shared memory regions with the process's own mappings, each
+ * at the address and with the protections given in the .system file. Regions the process does not
+ * map are not accessible to it at all.
+ * @param process The process whose regions are being mapped
+ */
+static void map_shared_memory_regions(process_t *process) {
+    for (int i = 0; i < num_shared_memory_regions; ++i) {
+        munmap(shared_memory_regions[i]->shared_buffer, shared_memory_regions[i]->size);
+    }
+
+    for (shared_memory_stack_t *curr = process->shared_memory; curr != NULL; curr = curr->next) {
+        curr->mapped = map_shared_memory(curr->shm, curr->vaddr, curr->prot);
+        if (curr->mapped == MAP_FAILED) {
+            fprintf(stderr, "Error mapping a shared memory region at %p in %s: %s\n",
+                    curr->vaddr, process->name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 /**
  * Sets the address of the variables declared as shared within the process to the addresses
- * we stored internally in `loader.c`.
+ * the process mapped each region at.
  * @param handle A handle to the dynamically linked process to be opened.
  * @param process The information of the process we will be setting the shared memory of.
  */
 static void set_shared_memory(void *handle, process_t *process) {
     shared_memory_stack_t *curr = process->shared_memory;
     while (curr != NULL) {
+        if (curr->_varname == NULL) {
+            curr = curr->next;
+            continue;
+        }
         seL4_Word *buff = (seL4_Word *) dlsym(handle, curr->_varname);
         const char *dlsym_error = dlerror();
         if (dlsym_error != NULL) {
@@ -32,69 +104,399 @@ static void set_shared_memory(void *handle, process_t *process) {
             dlclose(handle);
             exit(EXIT_FAILURE);
         }
-        *buff = (seL4_Word) curr->shm->shared_buffer;
+        *buff = (seL4_Word) curr->mapped;
         curr = curr->next;
     }
 }
 
 /**
- * Finds the symbolic link for the `init` function in the process's elf
- * and executes it.
- * @param handle A handle to the dynamically linked process to be opened.
+ * Populates the page tables for a mapping up front and, if asked to, locks it in memory. Pages
+ * that are already present are left as they are, so this is safe on memory that is in use.
+ * @param addr The page aligned start of the mapping
+ * @param len The length of the mapping in bytes
+ * @param policy MEMORY_* flags saying what to do with it
+ * @return 0 on success, -1 if the memory could not be locked
  */
-static void execute_init(void *handle) {
-    void (*init)(void) = (void (*)(void)) dlsym(handle, "init");
-    const char *dlsym_error = dlerror();
-    if (dlsym_error != NULL) {
-        fprintf(stderr, "Error finding function \"init\": %s\n", dlsym_error);
-        dlclose(handle);
-        exit(EXIT_FAILURE);
+int populate_memory(void *addr, size_t len, int policy) {
+    if (policy & MEMORY_LOCK) {
+        // Locking faults every page in for writing, so it prefaults as well
+        return mlock(addr, len);
+    }
+    if (policy & MEMORY_PREFAULT) {
+        if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) return 0;
+        // Kernels before 5.14 do not know MADV_POPULATE_WRITE, but locking and unlocking has the same effect
+        if (mlock(addr, len) == 0) munlock(addr, len);
+    }
+    return 0;
+}
+
+/**
+ * Prefaults and locks the memory of the current process as its memory policies ask, so that its
+ * first messages do not take page faults. Shared regions were already populated by the loader,
+ * but each process still has to fill in its own page tables.
+ * @param process The process being started
+ */
+static void prefault_process(process_t *process) {
+    uint64_t start_ns = monotonic_ns();
+    uint64_t bytes = 0;
+    int lock_failed = 0;
+    int locked = process->memory_policy & MEMORY_LOCK;
+    int policy = process->memory_policy;
+    if (policy != 0) {
+        lock_failed |= populate_memory(process->stack_top - process->stack_size, process->stack_size, policy);
+        lock_failed |= populate_memory(process->sig_handler_stack, SIGSTKSZ, policy);
+        lock_failed |= populate_memory(process->ipc_buffer, IPC_BUFFER_SIZE * sizeof(seL4_Word), policy);
+        lock_failed |= populate_memory(process->control, sizeof(pd_control_t), policy);
+        lock_failed |= populate_memory(process->call_buffers, MICROKIT_MAX_PDS * IPC_BUFFER_SIZE * sizeof(seL4_Word), policy);
+        bytes += process->stack_size + SIGSTKSZ + IPC_BUFFER_SIZE * sizeof(seL4_Word) + sizeof(pd_control_t);
+        bytes += MICROKIT_MAX_PDS * IPC_BUFFER_SIZE * sizeof(seL4_Word);
+    }
+    for (shared_memory_stack_t *curr = process->shared_memory; curr != NULL; curr = curr->next) {
+        if (curr->shm->memory_policy == 0) continue;
+        locked |= curr->shm->memory_policy & MEMORY_LOCK;
+        lock_failed |= populate_memory(curr->mapped, curr->shm->size, curr->shm->memory_policy);
+        bytes += curr->shm->size;
     }
+    if (bytes == 0) return;
 
-    init();
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    printf("%s: prefaulted %lu KiB%s in %lu us\n", process->name, bytes / 1024,
+           locked && !lock_failed ? " and locked" : "", elapsed_ns / 1000);
+    if (lock_failed) {
+        fprintf(stderr, "Warning: could not lock the memory of %s (raise RLIMIT_MEMLOCK or grant CAP_IPC_LOCK)\n",
+                process->name);
+    }
 }
 
 /**
- * Finds the symbolic link for the `notified` function in the process's elf
- * and executes it.
+ * Looks up the `init`, `notified`, `protected` and `replied` functions in the process's elf and stores them in
+ * the process's dispatch table. This is done once after `dlopen` so that handling an event is a plain
+ * indirect call. Entry points the process does not define are left as NULL.
  * @param handle A handle to the dynamically linked process to be opened.
+ * @param process The process whose dispatch table we will be filling in.
+ */
+static void resolve_entry_points(void *handle, process_t *process) {
+    process->entry.init = (void (*)(void)) dlsym(handle, "init");
+    process->entry.notified = (void (*)(microkit_channel)) dlsym(handle, "notified");
+    process->entry.protected = (microkit_msginfo (*)(microkit_channel, microkit_msginfo)) dlsym(handle, "protected");
+    process->entry.replied = (void (*)(microkit_channel, microkit_msginfo)) dlsym(handle, "replied");
+    dlerror(); // Missing symbols are not an error, so discard whatever dlsym left behind
+}
+
+/**
+ * Sends the notifications that the entry point which just returned deferred.
+ * @param process The current process
+ */
+static inline void flush_after_entry(process_t *process) {
+    if (process->deferred_notify != 0) flush_deferred_notifications();
+}
+
+/**
+ * Executes the process's `init` function, if it has one.
+ * @param process The process being initialised
+ */
+static void execute_init(process_t *process) {
+    if (process->entry.init != NULL) {
+        trace(process, TRACE_INIT_BEGIN, 0);
+        process->entry.init();
+        trace(process, TRACE_INIT_END, 0);
+        flush_after_entry(process);
+    }
+}
+
+/**
+ * Executes the process's `notified` function, if it has one.
+ * @param process The process being notified
  * @param ch An unsigned integer to the channel id we will be notifying
  */
-static void execute_notified(void *handle, microkit_channel ch) {
-    void (*notified)(microkit_channel) = dlsym(handle, "notified");
-    const char *dlsym_error = dlerror();
-    if (dlsym_error != NULL) {
-        fprintf(stderr, "Error finding function \"notified\": %s\n", dlsym_error);
-        dlclose(handle);
-        exit(EXIT_FAILURE);
+static void execute_notified(process_t *process, microkit_channel ch) {
+    process->control->stats.notifications++;
+    process->control->stats.wakeup_events++;
+    if (process->latency != NULL) {
+        // A sender that raced with us taking the word may have stamped the next batch, which then goes unmeasured
+        uint64_t sent_ns = atomic_exchange(&process->control->notify_sent[ch], 0);
+        if (sent_ns != 0) histogram_record(process->latency->notify[ch], monotonic_ns() - sent_ns);
+    }
+    if (process->entry.notified != NULL) {
+        trace(process, TRACE_NOTIFIED_BEGIN, ch);
+        process->entry.notified(ch);
+        trace(process, TRACE_NOTIFIED_END, ch);
+        flush_after_entry(process);
+    }
+}
+
+/**
+ * Executes the process's `protected` function and returns its reply. A process without a
+ * `protected` function answers with an seL4_InvalidCapability label so the caller is not left
+ * blocked forever.
+ * @param process The process receiving the protected procedure call
+ * @param ch The channel the call was made on
+ * @param msginfo The message information sent by the caller
+ */
+static microkit_msginfo dispatch_protected(process_t *process, microkit_channel ch, microkit_msginfo msginfo) {
+    process->control->stats.ppcs++;
+    process->control->stats.wakeup_events++;
+    if (process->entry.protected == NULL) {
+        return microkit_msginfo_new(seL4_InvalidCapability, 0);
+    }
+
+    // Callers leave their message registers in our IPC buffer for the channel they call on
+    seL4_Word *call_buffer = process->call_buffers + ch * IPC_BUFFER_SIZE;
+    process->mrs = call_buffer;
+
+    trace(process, TRACE_PROTECTED_BEGIN, ch);
+    microkit_msginfo reply = process->entry.protected(ch, msginfo);
+    trace(process, TRACE_PROTECTED_END, ch);
+
+    // A nested call over a shared IPC buffer moves the registers, but the caller reads its reply from its own
+    if (process->mrs != call_buffer) {
+        seL4_Uint16 count = microkit_msginfo_get_count(reply);
+        memcpy(call_buffer, process->mrs, (count < IPC_BUFFER_SIZE ? count : IPC_BUFFER_SIZE) * sizeof(seL4_Word));
     }
+    // The buffer is the caller's again once we reply, so registers set from here on must not land in it
+    process->mrs = process->ipc_buffer;
 
-    notified(ch);
+    flush_after_entry(process); // Before the reply, so the caller can count on them having been sent
+    return reply;
 }
 
 /**
- * Finds the symbolic link for the `protected` function in the process's elf
- * and executes it.
- * @param buf A struct with the information needed to send and reply to a message
+ * Posts the reply to an asynchronous call to the caller's control block. Replies are bits of a word
+ * like notifications, and only the reply that makes the word non-empty rings the caller's eventfd.
+ * Every reply wakes a caller blocked in `microkit_ppcall_wait`, which may be waiting for this one.
+ * @param caller The process that made the call
+ * @param caller_ch The id the caller knows the channel by
+ * @param reply The reply
  */
-static void execute_protected(void *handle, message_t msg) {
-    microkit_msginfo (*protected)(microkit_channel, microkit_msginfo) = dlsym(handle, "protected");
-    const char *dlsym_error = dlerror();
-    if (dlsym_error != NULL) {
-        fprintf(stderr, "Error finding function \"protected\": %s\n", dlsym_error);
-        dlclose(handle);
-        exit(EXIT_FAILURE);
+void post_reply(process_t *caller, microkit_channel caller_ch, microkit_msginfo reply) {
+    pd_control_t *control = caller->control;
+    control->replies[caller_ch] = reply;
+    uint64_t pending = atomic_fetch_or(&control->replied, 1ull << caller_ch);
+    if (pending == 0) {
+        uint64_t ring = 1;
+        write(caller->notification, &ring, sizeof(uint64_t));
     }
+    wake_receiver(caller);
+}
 
-    microkit_msginfo info = protected(msg.ch, msg.msginfo);
+/**
+ * Executes the process's `protected` function and writes its reply back to the caller's pipe.
+ * @param process The process receiving the protected procedure call
+ * @param msg A struct with the information needed to send and reply to a message
+ * @param ring The io_uring to queue the reply on, or NULL to write it straight away
+ */
+static void execute_protected(process_t *process, message_t msg, uring_t *ring) {
+    microkit_msginfo info = dispatch_protected(process, msg.ch, msg.msginfo);
+    if (msg.send_back == -1) {
+        post_reply(msg.caller, msg.caller_ch, info);
+        return;
+    }
+#if MICROKIT_IO_URING
+    if (ring != NULL) {
+        uring_write_reply(ring, msg.send_back, info);
+        return;
+    }
+#endif
     write(msg.send_back, &info, sizeof(microkit_msginfo));
+    process->control->stats.syscalls++;
+}
+
+/**
+ * Takes the reply to an asynchronous call and gives it to the process's `replied` function.
+ * @param process The process that made the call
+ * @param ch The channel the call was made on
+ */
+static void execute_replied(process_t *process, microkit_channel ch) {
+    microkit_msginfo reply = take_reply(ch);
+    trace(process, TRACE_REPLIED_BEGIN, ch);
+    process->entry.replied(ch, reply);
+    trace(process, TRACE_REPLIED_END, ch);
+    flush_after_entry(process);
+}
+
+/**
+ * Delivers the notifications pending in the process's notification word, then the replies to its
+ * asynchronous calls if it has a `replied` function.
+ * @param process The process whose notification eventfd was rung
+ */
+static void handle_notifications(process_t *process) {
+    uint64_t pending = atomic_exchange(&process->control->notifications, 0);
+    while (pending != 0) {
+        execute_notified(process, __builtin_ctzll(pending));
+        pending &= pending - 1;
+    }
+
+    // Without a `replied` function, replies wait for microkit_ppcall_wait or microkit_ppcall_poll
+    uint64_t replies = process->entry.replied != NULL ? atomic_exchange(&process->control->replied, 0) : 0;
+    while (replies != 0) {
+        execute_replied(process, __builtin_ctzll(replies));
+        replies &= replies - 1;
+    }
+}
+
+/**
+ * Serves the protected procedure calls queued in the process's pipe, reading up to PPC_READ_BATCH
+ * messages per `read`. It stops once the pipe is empty or `drain_budget` calls have been served, so
+ * that a flooded pipe cannot starve notifications; epoll reports the pipe again if anything is left.
+ * @param process The receiving process
+ */
+static void drain_pipe_calls(process_t *process) {
+    message_t batch[PPC_READ_BATCH];
+    unsigned int budget = process->drain_budget;
+
+    while (budget > 0) {
+        size_t wanted = budget < PPC_READ_BATCH ? budget : PPC_READ_BATCH;
+        ssize_t got = read(process->send_pipe[PIPE_READ_FD], batch, wanted * sizeof(message_t));
+        process->control->stats.syscalls++;
+        if (got <= 0) return; // EAGAIN, the pipe is empty
+
+        // Every write is a whole message_t below PIPE_BUF, so reads only ever return whole messages
+        size_t count = got / sizeof(message_t);
+        for (size_t i = 0; i < count; ++i) {
+            execute_protected(process, batch[i], NULL);
+        }
+        budget -= count;
+
+        // A short read means the pipe was emptied, which saves the read that would return EAGAIN
+        if (count < wanted) return;
+    }
+
+    // The last full batch may have emptied the pipe exactly, which only counts if calls are left
+    int queued = 0;
+    ioctl(process->send_pipe[PIPE_READ_FD], FIONREAD, &queued);
+    process->control->stats.syscalls++;
+    if (queued > 0) process->control->stats.budget_exhausted++;
+}
+
+/**
+ * Starts accounting for a new wakeup of the event loop.
+ * @param stats The counters of the woken process
+ */
+static void begin_wakeup(pd_stats_t *stats) {
+    if (stats->wakeup_events > stats->max_wakeup_events) {
+        stats->max_wakeup_events = stats->wakeup_events;
+    }
+    stats->wakeup_events = 0;
+    stats->wakeups++;
+}
+
+/**
+ * Checks whether any futex channel into the process has a call waiting to be served.
+ * @param process The receiving process
+ */
+static int fast_call_pending(process_t *process) {
+    for (int i = 0; i < process->num_fast_slots; ++i) {
+        if (atomic_load(&process->control->slots[i].state) == PPC_SLOT_CALL) return 1;
+    }
+    return 0;
 }
 
 /**
- * The signal handler of the child process. Currently only used to catch stack overflows.
+ * Serves every call currently waiting in one of the process's futex call slots, writing the reply
+ * into the slot and waking the caller.
+ * @param process The receiving process
+ * @return Whether any call was served
+ */
+static int serve_fast_calls(process_t *process) {
+    int served = 0;
+    for (int i = 0; i < process->num_fast_slots; ++i) {
+        ppc_slot_t *slot = &process->control->slots[i];
+        if (atomic_load(&slot->state) != PPC_SLOT_CALL) continue;
+
+        slot->msginfo = dispatch_protected(process, slot->ch, slot->msginfo);
+        atomic_store(&slot->state, PPC_SLOT_REPLY);
+        if (slot->async) {
+            // The caller is not waiting on the slot; it frees the slot when it takes the reply
+            post_reply(slot->caller, slot->caller_ch, slot->msginfo);
+        } else {
+            futex_wake(&slot->state, 1);
+            process->control->stats.syscalls++;
+        }
+        served = 1;
+    }
+    return served;
+}
+
+/**
+ * The fused reply-and-wait step of the futex transport. Once it has replied, the process parks on
+ * its event sequence for up to PPC_REPLY_WAIT_NS, since a caller usually comes straight back with
+ * its next call. It returns to the epoll loop as soon as a wait ends without a futex call to serve.
+ * @param process The receiving process
+ */
+static void reply_and_wait(process_t *process) {
+    pd_control_t *control = process->control;
+    const struct timespec timeout = {.tv_sec = 0, .tv_nsec = PPC_REPLY_WAIT_NS};
+
+    while (serve_fast_calls(process)) {
+        atomic_store(&control->wait_state, PD_WAIT_FUTEX);
+        uint32_t seq = atomic_load(&control->event_seq);
+        if (!fast_call_pending(process) && !atomic_load(&control->epoll_pending)) {
+            futex_wait(&control->event_seq, seq, &timeout);
+            control->stats.syscalls++;
+        }
+        atomic_store(&control->wait_state, PD_RUNNING);
+        begin_wakeup(&control->stats);
+        trace(process, TRACE_WAKEUP, 0);
+    }
+}
+
+/**
+ * Checks whether anything was posted to the process since its event sequence was `seq`, or is
+ * still waiting from before.
+ * @param process The receiving process
+ * @param seq The event sequence when the process last looked
+ */
+static int work_pending(process_t *process, uint32_t seq) {
+    pd_control_t *control = process->control;
+    return atomic_load_explicit(&control->event_seq, memory_order_acquire) != seq ||
+           atomic_load_explicit(&control->notifications, memory_order_relaxed) != 0 ||
+           fast_call_pending(process);
+}
+
+/**
+ * Spins for work for up to the process's poll window before the event loop blocks, so that work
+ * arriving soon after the last is picked up without a sleep and wakeup. Every poster bumps the
+ * event sequence, which is all the spin has to watch. The window doubles while most of the latest
+ * POLL_HISTORY spins find work within it and halves while few do, between POLL_MIN_WINDOW_NS and
+ * `poll_ns`.
+ * @param process The process, with a `poll_ns` set
+ * @return Whether work turned up before the window ran out
+ */
+static int busy_poll(process_t *process) {
+    pd_stats_t *stats = &process->control->stats;
+    uint32_t seq = atomic_load(&process->control->event_seq);
+    uint64_t start = monotonic_ns(), now = start;
+    int hit = 0;
+
+    for (unsigned int spins = 1; !(hit = work_pending(process, seq)); ++spins) {
+        cpu_relax();
+        if (spins % POLL_CLOCK_SPINS == 0 && (now = monotonic_ns()) - start >= stats->poll_window_ns) break;
+    }
+    if (hit) now = monotonic_ns();
+
+    stats->poll_spin_ns += now - start;
+    hit ? stats->poll_hits++ : stats->poll_sleeps++;
+
+    // Work that only turned up after the window ran out most likely needed us off the CPU to arrive
+    int paid_off = hit && now - start <= stats->poll_window_ns;
+    process->poll_history = (process->poll_history << 1 | paid_off) & ((1u << POLL_HISTORY) - 1);
+    int hits = __builtin_popcount(process->poll_history);
+    if (hits >= POLL_GROW_HITS) {
+        stats->poll_window_ns = stats->poll_window_ns * 2 < process->poll_ns ? stats->poll_window_ns * 2 : process->poll_ns;
+    } else if (hits <= POLL_SHRINK_HITS) {
+        stats->poll_window_ns = stats->poll_window_ns / 2 > POLL_MIN_WINDOW_NS ? stats->poll_window_ns / 2 : POLL_MIN_WINDOW_NS;
+    }
+    return hit;
+}
+
+/**
+ * The signal handler of the child process. Catches stack overflows, and accesses that the
+ * protections of a mapped region do not allow.
  * @param sig The signal number delivered to the handler
+ * @param info Where the fault happened
+ * @param context Unused
  */
-void sig_handler(int sig) {
+void sig_handler(int sig, siginfo_t *info, void *context) {
     if (sig != SIGSEGV) {
         fprintf(stderr, "Unknown error detected!\n");
         exit(EXIT_FAILURE);
@@ -107,11 +509,189 @@ void sig_handler(int sig) {
     size = backtrace(array, 10);
 
     // print out all the frames to stderr
-    fprintf(stderr, "Stack overflow detected:\n");
+    char *guard_page = proc->stack_top - proc->stack_size - PAGE_SIZE;
+    if ((char *) info->si_addr >= guard_page && (char *) info->si_addr < guard_page + PAGE_SIZE) {
+        fprintf(stderr, "Stack overflow detected:\n");
+    } else {
+        fprintf(stderr, "Segmentation fault at %p in %s:\n", info->si_addr, proc->name);
+    }
     backtrace_symbols_fd(array, size, STDERR_FILENO);
     exit(EXIT_FAILURE);
 }
 
+/**
+ * Counts the SIGXCPUs SCHED_DEADLINE sends when the process runs past its CPU budget.
+ * @param sig The signal number delivered to the handler
+ */
+static void overrun_handler(int sig) {
+    proc->control->stats.deadline_overruns++;
+}
+
+/**
+ * What the event loop does before it waits on its fds: serves the futex calls, busy polls if the
+ * process asks for it, and tells futex callers and notifiers it is going to sleep. Notifications
+ * sent while the process was running are delivered here, as they did not ring its eventfd.
+ * @param process The current process
+ * @param block Set to whether the wait should block, or only collect work busy polling found
+ * @return Whether to wait, or go round again because a futex call came in
+ */
+static int ready_to_wait(process_t *process, int *block) {
+    pd_control_t *control = process->control;
+    if (process->num_fast_slots > 0) {
+        reply_and_wait(process);
+    }
+
+    // Work found by spinning is already in the fds and slots, so the wait only has to collect it
+    *block = !(process->poll_ns > 0 && busy_poll(process));
+
+    // Futex callers and notifiers only ring our fds once they see us waiting, so look again after saying so
+    atomic_store(&control->wait_state, PD_WAIT_EPOLL);
+    if (process->num_fast_slots > 0 && fast_call_pending(process)) {
+        atomic_store(&control->wait_state, PD_RUNNING);
+        return 0;
+    }
+    if (atomic_load(&control->notifications) != 0) {
+        atomic_store(&control->wait_state, PD_RUNNING);
+        handle_notifications(process);
+        return 0;
+    }
+
+    // Anything posted from here on is either seen by the wait or raises the flag again
+    atomic_store(&control->epoll_pending, 0);
+    return 1;
+}
+
+/**
+ * The event loop of a process that waits with `epoll_wait` and reads each of its fds that is ready.
+ * @param process The current process
+ */
+static void epoll_event_loop(process_t *process) {
+    int epoll_fd = epoll_create1(0);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = process->notification};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, process->notification, &event) == -1) {
+        fprintf(stderr, "Failed to initialise polling for notifications");
+        exit(EXIT_FAILURE);
+    }
+
+    event = (struct epoll_event){.events = EPOLLIN, .data.fd = process->send_pipe[PIPE_READ_FD]};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, process->send_pipe[PIPE_READ_FD], &event) == -1) {
+        fprintf(stderr, "Failed to initialise polling for ppc");
+        exit(EXIT_FAILURE);
+    }
+
+    event = (struct epoll_event){.events = EPOLLIN, .data.fd = process->ppc_doorbell};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, process->ppc_doorbell, &event) == -1) {
+        fprintf(stderr, "Failed to initialise polling for futex ppc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    pd_control_t *control = process->control;
+
+    for (;;) {
+        int block;
+        if (!ready_to_wait(process, &block)) continue;
+
+        int nfds = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, block ? -1 : 0);
+        control->stats.syscalls++;
+        atomic_store(&control->wait_state, PD_RUNNING);
+        if (nfds == -1) {
+            // Signals, and being stopped and continued by the budget monitor, interrupt the wait
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll wait failed");
+            exit(EXIT_FAILURE);
+        }
+        begin_wakeup(&control->stats);
+        trace(process, TRACE_WAKEUP, 0);
+
+        for (int i = 0; i < nfds; ++i) {
+            if (events[i].data.fd == process->notification) {
+                // The eventfd is only a doorbell, the notifications themselves are in the control block
+                uint64_t rings;
+                read(process->notification, &rings, sizeof(uint64_t));
+                control->stats.syscalls++;
+                handle_notifications(process);
+            } else if (events[i].data.fd == process->send_pipe[PIPE_READ_FD]) {
+                drain_pipe_calls(process);
+            } else if (events[i].data.fd == process->ppc_doorbell) {
+                // The calls themselves are served by reply_and_wait at the top of the loop
+                uint64_t rings;
+                read(process->ppc_doorbell, &rings, sizeof(uint64_t));
+                control->stats.syscalls++;
+            }
+        }
+    }
+}
+
+#if MICROKIT_IO_URING
+/**
+ * The event loop of a process that waits with io_uring. A multishot read stays armed on each fd,
+ * so the data arrives along with the wakeup, and replies to pipe calls are queued on the ring to
+ * go out with the next wait. With SQPOLL, a kernel thread sends them even sooner. Calls read from
+ * the pipe are all served, as the drain budget only applies to the epoll loop, but they take turns
+ * with notifications in the order they arrived.
+ * @param process The current process
+ */
+static void uring_event_loop(process_t *process) {
+    uring_t *ring = uring_create(process, process->event_loop == EVENT_LOOP_IO_URING_SQPOLL);
+    const int fds[] = {
+        [URING_NOTIFICATION] = process->notification,
+        [URING_PIPE_CALLS] = process->send_pipe[PIPE_READ_FD],
+        [URING_DOORBELL] = process->ppc_doorbell,
+    };
+    for (int event = URING_NOTIFICATION; event <= URING_DOORBELL; ++event) {
+        uring_read_multishot(ring, fds[event], event);
+    }
+
+    pd_control_t *control = process->control;
+    for (;;) {
+        int block;
+        if (process->num_fast_slots > 0 || process->poll_ns > 0) {
+            // Send the replies before parking for the next futex call or spinning, as their callers
+            // cannot send more work until they have them. Otherwise they go with the wait.
+            uring_submit(ring);
+        }
+        if (!ready_to_wait(process, &block)) continue;
+
+        int ret = uring_enter(ring, block);
+        atomic_store(&control->wait_state, PD_RUNNING);
+        if (ret < 0) {
+            if (ret == -EINTR) continue;
+            fprintf(stderr, "io_uring wait failed in %s: %s\n", process->name, strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+        begin_wakeup(&control->stats);
+        trace(process, TRACE_WAKEUP, 0);
+
+        struct io_uring_cqe cqe;
+        while (uring_next(ring, &cqe)) {
+            if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+                fprintf(stderr, "io_uring read failed in %s: %s\n", process->name, strerror(-cqe.res));
+                exit(EXIT_FAILURE);
+            }
+
+            if (cqe.user_data == URING_NOTIFICATION && cqe.res > 0) {
+                handle_notifications(process);
+            } else if (cqe.user_data == URING_PIPE_CALLS && cqe.res > 0) {
+                // Every write is a whole message_t and every buffer holds whole ones, as for drain_pipe_calls
+                message_t *batch = uring_buffer(ring, &cqe);
+                for (size_t i = 0; i < cqe.res / sizeof(message_t); ++i) {
+                    execute_protected(process, batch[i], ring);
+                }
+            }
+            // Doorbell rings need no handling, the calls are served by reply_and_wait
+
+            uring_release(ring, &cqe);
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                // Out of buffers, now that some are back the read can be armed again
+                uring_read_multishot(ring, fds[cqe.user_data], cqe.user_data);
+            }
+        }
+    }
+}
+#endif
+
 /**
  * The main function that will be executed by the handler. Its main job is to:
  * 
@@ -133,58 +713,52 @@ int event_handler(void *arg) {
     }
 
     // Install signal handler
-    struct sigaction sa = {.sa_handler = sig_handler, .sa_flags = SA_ONSTACK};
+    struct sigaction sa = {.sa_sigaction = sig_handler, .sa_flags = SA_ONSTACK | SA_SIGINFO};
     sigemptyset(&sa.sa_mask);
     if (sigaction(SIGSEGV, &sa, NULL) == -1) {
         perror("sigaction");
         exit(1);
     }
 
-    // Dynamically loads the process at runtime
-    void *handle = dlopen(proc->_path, RTLD_LAZY);
-    if (handle == NULL) {
-        fprintf(stderr, "Error opening file: %s\n", dlerror());
-        exit(EXIT_FAILURE);
+    struct sigaction overrun = {.sa_handler = overrun_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&overrun.sa_mask);
+    if (sigaction(SIGXCPU, &overrun, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
     }
 
-    set_shared_memory(handle, proc);
-    execute_init(handle);
-
-    int epoll_fd = epoll_create1(0);
+    pd_startup_t *startup = &proc->control->startup;
+    startup->started_ns = monotonic_ns();
 
-    struct epoll_event event = {.events = EPOLLIN, .data.fd = proc->notification};
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, proc->notification, &event) == -1) {
-        fprintf(stderr, "Failed to initialise polling for notifications");
-        exit(EXIT_FAILURE);
-    }
+    // Map the regions first, so that nothing opened below can take their addresses
+    release_preloaded_images(proc);
+    map_shared_memory_regions(proc);
 
-    event = (struct epoll_event){.events = EPOLLIN, .data.fd = proc->send_pipe[PIPE_READ_FD]};
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, proc->send_pipe[PIPE_READ_FD], &event) == -1) {
-        fprintf(stderr, "Failed to initialise polling for ppc");
+    // Dynamically loads the process at runtime, unless the loader already did and we inherited it
+    void *handle = proc->image != NULL ? proc->image : dlopen(proc->_path, RTLD_LAZY);
+    if (handle == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", dlerror());
         exit(EXIT_FAILURE);
     }
 
-    struct epoll_event events[2];
+    set_shared_memory(handle, proc);
+    resolve_entry_points(handle, proc);
+    startup->loaded_ns = monotonic_ns();
+    prefault_process(proc);
+    startup->init_ns = monotonic_ns();
+    execute_init(proc);
+    startup->ready_ns = monotonic_ns();
 
-    for (;;) {
-        int nfds = epoll_wait(epoll_fd, events, 2, -1);
-        if (nfds == -1) {
-            fprintf(stderr, "epoll wait failed");
-            exit(EXIT_FAILURE);
-        }
+    // Start out assuming busy polling pays off, with the whole window
+    proc->control->stats.poll_window_ns = proc->poll_ns;
+    proc->poll_history = (1u << POLL_HISTORY) - 1;
 
-        for (int i = 0; i < nfds; ++i) {
-            if (events[i].data.fd == proc->notification) {
-                microkit_channel channel;
-                read(proc->notification, &channel, sizeof(microkit_channel));
-                execute_notified(handle, channel);
-            } else if (events[i].data.fd == proc->send_pipe[PIPE_READ_FD]) {
-                message_t msg;
-                read(proc->send_pipe[PIPE_READ_FD], &msg, sizeof(message_t));
-                execute_protected(handle, msg);
-            }
-        }
+#if MICROKIT_IO_URING
+    if (proc->event_loop != EVENT_LOOP_EPOLL) {
+        uring_event_loop(proc);
     }
+#endif
+    epoll_event_loop(proc);
 
     dlclose(handle);
     return 0;
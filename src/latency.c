@@ -0,0 +1,127 @@
+/**
+ * Latency histograms of protected procedure calls and notifications. The loader lays out every
+ * histogram in a single shared stats region before the protection domains start, the domains
+ * record into them without any system calls, and the loader reads them whenever it is asked to.
+ */
+
+#define _GNU_SOURCE
+
+#include <handler.h>
+#include <sys/mman.h>
+#include <string.h>
+
+static process_t **measured_processes = NULL;
+static int num_measured_processes = 0;
+
+/**
+ * Gives every channel of the provided processes a round trip histogram at the calling end and a
+ * notification histogram at the receiving end, all in one stats region shared with the children.
+ * 
+ * @param processes Handles to the processes, in the order they should be reported in
+ * @param count The number of processes
+ */
+void enable_latency_stats(process_t **processes, int count) {
+    size_t histograms = 0;
+    for (int i = 0; i < count; ++i) {
+        histograms += 2 * kh_size(processes[i]->channel_id_to_process);
+    }
+
+    size_t size = count * sizeof(latency_stats_t) + histograms * sizeof(histogram_t);
+    char *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "Error on creating the latency stats region\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        processes[i]->latency = (latency_stats_t *) region;
+        region += sizeof(latency_stats_t);
+    }
+
+    histogram_t *next = (histogram_t *) region;
+    for (int i = 0; i < count; ++i) {
+        khash_t(channel) *channels = processes[i]->channel_id_to_process;
+        for (khiter_t iter = kh_begin(channels); iter != kh_end(channels); ++iter) {
+            if (!kh_exist(channels, iter)) continue;
+            channel_t *channel = kh_value(channels, iter);
+            processes[i]->latency->ppc[kh_key(channels, iter)] = next++;
+            channel->receiver->latency->notify[channel->peer_ch] = next++;
+        }
+    }
+
+    measured_processes = malloc(count * sizeof(process_t *));
+    if (measured_processes == NULL) {
+        fprintf(stderr, "Error on allocating the list of measured processes\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(measured_processes, processes, count * sizeof(process_t *));
+    num_measured_processes = count;
+}
+
+/**
+ * Finds the latency below which the given fraction of the recorded values fall, to within the
+ * histogram's precision.
+ * 
+ * @param histogram A histogram with at least one value
+ * @param fraction Between 0 and 1
+ */
+static uint64_t histogram_percentile(histogram_t *histogram, double fraction) {
+    uint64_t wanted = (uint64_t) (fraction * histogram->count + 0.5);
+    if (wanted == 0) wanted = 1;
+
+    uint64_t seen = 0;
+    for (uint64_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+        seen += histogram->buckets[bucket];
+        if (seen < wanted) continue;
+
+        // Report the top of the bucket, but never more than was actually seen
+        uint64_t top = bucket;
+        if (bucket >= (1ULL << HISTOGRAM_SUB_BITS)) {
+            int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+            uint64_t sub_bucket = bucket & ((1ULL << HISTOGRAM_SUB_BITS) - 1);
+            top = (((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket + 1) << shift) - 1;
+        }
+        return top < histogram->max ? top : histogram->max;
+    }
+    return histogram->max;
+}
+
+/**
+ * Prints one line of percentiles, if the histogram has seen anything.
+ */
+static void print_histogram(FILE *out, const char *name, const char *kind, microkit_channel ch, histogram_t *histogram) {
+    if (histogram == NULL || histogram->count == 0) return;
+
+    fprintf(out, "%s ch %lu %s: %lu samples, p50 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n",
+            name, ch, kind, histogram->count,
+            histogram_percentile(histogram, 0.5) / 1000.0, histogram_percentile(histogram, 0.99) / 1000.0,
+            histogram_percentile(histogram, 0.999) / 1000.0, histogram->max / 1000.0);
+}
+
+/**
+ * Prints the percentiles of every channel that has seen calls or notifications. The histograms
+ * are read while the domains keep recording, so a snapshot may be off by the values in flight.
+ * 
+ * @param path A file to overwrite with the report, or NULL for stdout. This is a Rust owned string.
+ */
+void print_latency_stats(const char *path) {
+    FILE *out = path == NULL ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error on opening latency stats file %s\n", path);
+        return;
+    }
+
+    for (int i = 0; i < num_measured_processes; ++i) {
+        process_t *process = measured_processes[i];
+        for (microkit_channel ch = 0; ch < MICROKIT_MAX_PDS; ++ch) {
+            print_histogram(out, process->name, "ppcall", ch, process->latency->ppc[ch]);
+            print_histogram(out, process->name, "notified", ch, process->latency->notify[ch]);
+        }
+    }
+
+    if (path == NULL) {
+        fflush(out);
+    } else {
+        fclose(out);
+    }
+}
@@ -12,7 +12,59 @@
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <limits.h>
+
+#ifndef SCHED_FLAG_DL_OVERRUN
+#define SCHED_FLAG_DL_OVERRUN 0x04
+#endif
+
+/* The kernel's struct sched_attr, declared here as glibc only started providing it in 2.41 */
+struct deadline_attr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+/* An image the loader opened before cloning the processes that run it */
+typedef struct {
+    const char *path;
+    char *real_path; // As /proc/self/maps names the files it maps
+    void *handle;
+} preloaded_image_t;
+
+// Images opened by the loader, when asked to, so that every process running one inherits it
+static int preload = 0;
+static preloaded_image_t *preloaded_images = NULL;
+static int num_preloaded_images = 0;
+
+// How long the loader spent on opening images and on cloning processes
+static uint64_t preload_ns = 0;
+static uint64_t clone_ns = 0;
+static uint64_t first_clone_ns = 0;
+
+// Processes whose CPU budget may have to be enforced by the loader's monitor thread
+static process_t **budgeted_processes = NULL;
+static int num_budgeted_processes = 0;
+static pthread_t budget_monitor_thread;
+static atomic_int budget_monitor_running = 0;
+
+// Every shared memory region created, so that children can unmap the loader's views of them
+shared_memory_t **shared_memory_regions = NULL;
+int num_shared_memory_regions = 0;
+static pthread_mutex_t shared_memory_regions_lock = PTHREAD_MUTEX_INITIALIZER; // Tests create regions in parallel
 
 /**
  * Creates the process data and returns a handle to it.
@@ -63,12 +115,30 @@ process_t *create_process(const char *name, uint32_t stack_size) {
         fprintf(stderr, "Error on creating ipc buffer in %s\n", name);
         exit(EXIT_FAILURE);
     }
+    new->mrs = new->ipc_buffer;
+
+    // Every channel has its own buffer for incoming calls, so that concurrent callers cannot overwrite each other
+    new->call_buffers = mmap(NULL, MICROKIT_MAX_PDS * IPC_BUFFER_SIZE * sizeof(seL4_Word),
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (new->call_buffers == MAP_FAILED) {
+        fprintf(stderr, "Error on creating call buffers in %s\n", name);
+        exit(EXIT_FAILURE);
+    }
     
     new->notification = eventfd(0, EFD_NONBLOCK);
-    if (new->notification == -1) {
+    new->ppc_doorbell = eventfd(0, EFD_NONBLOCK);
+    if (new->notification == -1 || new->ppc_doorbell == -1) {
         fprintf(stderr, "Error on creating eventfd in %s\n", name);
         exit(EXIT_FAILURE);
     }
+
+    // The control block is written by peers (futex calls, wakeups), so it must be shared after clone
+    new->control = mmap(NULL, sizeof(pd_control_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (new->control == MAP_FAILED) {
+        fprintf(stderr, "Error on creating control block in %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    new->num_fast_slots = 0;
     
     /**
      * Create the process's channels stored internally as UNIX pipes. Pipes are a unidirectional
@@ -83,17 +153,72 @@ process_t *create_process(const char *name, uint32_t stack_size) {
         fprintf(stderr, "Error on creating pipe in %s\n", name);
         exit(EXIT_FAILURE);
     }
+
+    // Only the receiving end drains its pipe until EAGAIN; senders still block when the pipe is full
+    if (fcntl(new->send_pipe[PIPE_READ_FD], F_SETFL, O_NONBLOCK) == -1) {
+        fprintf(stderr, "Error on making the ppc pipe non-blocking in %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    new->drain_budget = DEFAULT_DRAIN_BUDGET;
+    new->poll_ns = 0;
+    new->poll_history = 0;
+    new->event_loop = EVENT_LOOP_EPOLL;
+    new->defer_notify = 0;
+    new->deferred_notify = 0;
+    memset(new->groups, 0, sizeof(new->groups));
+    new->group_ids = 0;
+    new->priority = PRIORITY_UNSET;
+    new->pid = -1;
+    new->budget = (budget_t){.enforcement = BUDGET_NONE};
+    new->affinity = NULL;
+    new->affinity_size = 0;
+    new->name = strdup(name);
+    new->image = NULL;
+    new->trace = NULL;
+    console_process(new);
+    new->latency = NULL;
+    new->stack_size = stack_size;
+    new->memory_policy = 0;
+    new->async_calls = 0;
     
     return new;
 }
 
+/**
+ * Checks whether the kernel will back shared anonymous memory with transparent huge pages once
+ * it has been advised to.
+ */
+static int transparent_shmem_enabled(void) {
+    char setting[128] = {0};
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (file == NULL) return 0;
+    fread(setting, 1, sizeof(setting) - 1, file);
+    fclose(file);
+    return strstr(setting, "[never]") == NULL && strstr(setting, "[deny]") == NULL;
+}
+
 /**
  * Creates a segment of shared memory and returns a handle to it.
  * 
+ * The region is held by a memfd, so that every protection domain can map it at its own address and
+ * with its own permissions. Regions asking for 2 MiB or 1 GiB pages are first backed by the pages
+ * reserved in hugetlbfs. If none are reserved, the region is aligned to 2 MiB and advised for
+ * transparent huge pages instead. The backing each region actually got is reported.
+ * 
  * @param name A string corresponding to the name of the shared memory. This is a Rust owned string.
  * @param size An unsigned 64 bit integer corresponding to the size of the shared memory.
+ * @param page_size One of PAGE_SIZE, LARGE_PAGE_SIZE or HUGE_PAGE_SIZE. `size` must be a multiple of it.
  */
-shared_memory_t *create_shared_memory(const char *name, uint64_t size) {
+shared_memory_t *create_shared_memory(const char *name, uint64_t size, uint64_t page_size) {
+    if (page_size != PAGE_SIZE && page_size != LARGE_PAGE_SIZE && page_size != HUGE_PAGE_SIZE) {
+        fprintf(stderr, "Unsupported page size 0x%lx for %s\n", page_size, name);
+        exit(EXIT_FAILURE);
+    }
+    if (size == 0 || size % page_size != 0) {
+        fprintf(stderr, "Size of %s must be a non-zero multiple of its page size 0x%lx\n", name, page_size);
+        exit(EXIT_FAILURE);
+    }
+
     shared_memory_t *new = malloc(sizeof(shared_memory_t));
     if (new == NULL) {
         fprintf(stderr, "Error on allocating shared memory\n");
@@ -101,28 +226,126 @@ shared_memory_t *create_shared_memory(const char *name, uint64_t size) {
     }
     
     new->size = size;
+    new->page_size = page_size;
+    new->backing = BACKING_SMALL_PAGES;
+    new->memory_policy = 0;
     
     /**
      * Create the shared buffer within which the actual data shared between protection domains
-     * will be stored. Thus, we will mmap a set of anonymous memory which can be shared between processes.
+     * will be stored. The memfd outlives the loader's mapping of it and is inherited by every child.
      */
-    new->shared_buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    new->shared_buffer = MAP_FAILED;
+    if (page_size != PAGE_SIZE) {
+        // MFD_HUGE_SHIFT is the same as MAP_HUGE_SHIFT
+        int huge_flag = (page_size == HUGE_PAGE_SIZE ? 30 : 21) << MAP_HUGE_SHIFT;
+        new->fd = memfd_create(name, MFD_HUGETLB | huge_flag);
+        if (new->fd != -1 && ftruncate(new->fd, size) == 0) {
+            new->backing = BACKING_HUGETLB;
+            // Hugetlbfs pages are only taken from the pool when the region is mapped
+            new->shared_buffer = map_shared_memory(new, NULL, PROT_READ | PROT_WRITE);
+        }
+        if (new->shared_buffer == MAP_FAILED) {
+            if (new->fd != -1) close(new->fd);
+            new->backing = transparent_shmem_enabled() ? BACKING_TRANSPARENT : BACKING_SMALL_PAGES;
+        }
+    }
+    if (new->shared_buffer == MAP_FAILED) {
+        new->fd = memfd_create(name, 0);
+        if (new->fd == -1 || ftruncate(new->fd, size) == -1) {
+            fprintf(stderr, "Error on creating memfd for %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+        new->shared_buffer = map_shared_memory(new, NULL, PROT_READ | PROT_WRITE);
+    }
     if (new->shared_buffer == MAP_FAILED) {
         fprintf(stderr, "Error on allocating shared buffer for %s\n", name);
         exit(EXIT_FAILURE);
     }
+
+    switch (new->backing) {
+    case BACKING_HUGETLB:
+        printf("Memory region %s: 0x%lx bytes backed by %lu MiB hugetlbfs pages\n", name, size, page_size >> 20);
+        break;
+    case BACKING_TRANSPARENT:
+        printf("Memory region %s: 0x%lx bytes backed by transparent huge pages (no hugetlbfs pages reserved)\n",
+               name, size);
+        break;
+    default:
+        if (page_size != PAGE_SIZE) {
+            printf("Memory region %s: 0x%lx bytes backed by 4 KiB pages (no hugetlbfs pages reserved and "
+                   "transparent huge pages are disabled for shared memory)\n", name, size);
+        } else {
+            printf("Memory region %s: 0x%lx bytes backed by 4 KiB pages\n", name, size);
+        }
+    }
+
+    // Every domain drops the loader's views of all regions before mapping its own
+    pthread_mutex_lock(&shared_memory_regions_lock);
+    shared_memory_t **grown = realloc(shared_memory_regions, (num_shared_memory_regions + 1) * sizeof(shared_memory_t *));
+    if (grown == NULL) {
+        fprintf(stderr, "Error on allocating the list of shared memory regions\n");
+        exit(EXIT_FAILURE);
+    }
+    shared_memory_regions = grown;
+    shared_memory_regions[num_shared_memory_regions++] = new;
+    pthread_mutex_unlock(&shared_memory_regions_lock);
     
     return new;
 }
 
+/**
+ * Populates a shared memory region now rather than on first touch, and optionally locks it, so that
+ * the page cache side of the faults is paid once at startup. Every process that maps the region
+ * later fills in its own page tables before its `init` runs.
+ * 
+ * @param shm The shared memory region
+ * @param name The name of the region, for the startup report. This is a Rust owned string.
+ * @param policy MEMORY_* flags
+ */
+void set_shared_memory_policy(shared_memory_t *shm, const char *name, int policy) {
+    shm->memory_policy = policy;
+    if (policy == 0) return;
+
+    uint64_t start_ns = monotonic_ns();
+    int lock_failed = populate_memory(shm->shared_buffer, shm->size, policy);
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    printf("Memory region %s: prefaulted %lu KiB%s in %lu us\n", name, shm->size / 1024,
+           (policy & MEMORY_LOCK) && !lock_failed ? " and locked" : "", elapsed_ns / 1000);
+    if (lock_failed) {
+        fprintf(stderr, "Warning: could not lock memory region %s (raise RLIMIT_MEMLOCK or grant CAP_IPC_LOCK)\n", name);
+    }
+}
+
+/**
+ * Sets whether the stacks, IPC buffer and control block of a process are prefaulted and locked
+ * before its `init` runs. This happens in the child, as private pages populated by the loader
+ * would still be copied on the child's first write.
+ * 
+ * @param process The process
+ * @param policy MEMORY_* flags
+ */
+void set_memory_policy(process_t *process, int policy) {
+    process->memory_policy = policy;
+}
+
 /**
  * Adds the specified shared memory block to a list of shared memory accessible by the process.
+ * The process maps it at `vaddr` with `prot` before its image is opened.
  * 
  * @param process_handle Handle to the process (returned by create_process)
  * @param shm_handle Handle to the shared memory (returned by create_shared_memory)
- * @param shm_varname A string corresponding to the name of the variable in the process. This is a Rust owned string.
+ * @param shm_varname A string corresponding to the name of the variable in the process, or NULL. This is a Rust owned string.
+ * @param vaddr The address to map the region at in the process, or 0 to let the kernel choose.
+ * @param prot The PROT_* protections of the mapping.
  */
-void add_shared_memory(process_t *process, shared_memory_t *shared_memory, const char *shm_varname) {
+void add_shared_memory(process_t *process, shared_memory_t *shared_memory, const char *shm_varname,
+                       uint64_t vaddr, int prot) {
+    if (vaddr % shared_memory->page_size != 0) {
+        fprintf(stderr, "Address 0x%lx for a shared memory region in %s is not aligned to its page size 0x%lx\n",
+                vaddr, process->name, shared_memory->page_size);
+        exit(EXIT_FAILURE);
+    }
+
     // Add the shared memory struct to the stack stored in the process. Stacks give us constant push time.
     shared_memory_stack_t *head = process->shared_memory;
     process->shared_memory = malloc(sizeof(shared_memory_stack_t));
@@ -134,6 +357,24 @@ void add_shared_memory(process_t *process, shared_memory_t *shared_memory, const
     process->shared_memory->shm = shared_memory;
     process->shared_memory->_varname = shm_varname;
     process->shared_memory->next = head;
+    process->shared_memory->vaddr = (void *) vaddr;
+    process->shared_memory->prot = prot;
+    process->shared_memory->mapped = NULL;
+}
+
+/**
+ * Fails if a group notifies the process on a channel id. Notifications arrive as bits indexed by
+ * id, so the process could not tell the channel's notifications from the group's.
+ * 
+ * @param process Handle to the process
+ * @param ch The id of a channel in the process
+ */
+static void check_not_group_id(process_t *process, microkit_channel ch) {
+    if (process->group_ids & (1ull << ch)) {
+        fprintf(stderr, "Protection domain %s is notified by a group on id %lu, which a channel also uses\n",
+                process->name, ch);
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
@@ -141,9 +382,29 @@ void add_shared_memory(process_t *process, shared_memory_t *shared_memory, const
  * 
  * @param from_process Handle to the 'from' process
  * @param to_process Handle to the 'to' process
- * @param ch An unsigned integer corresponding to the id of this channel.
+ * @param ch An unsigned integer corresponding to the id of this channel in 'from'.
+ * @param peer_ch An unsigned integer corresponding to the id of this channel in 'to'.
  */
-void create_channel(process_t *from_process, process_t *to_process, microkit_channel ch) {
+void create_channel(process_t *from_process, process_t *to_process, microkit_channel ch, microkit_channel peer_ch) {
+    // Notifications are delivered as bits of a single word indexed by the receiver's channel id
+    if (ch >= MICROKIT_MAX_PDS || peer_ch >= MICROKIT_MAX_PDS) {
+        fprintf(stderr, "Channel ids must be less than %d\n", MICROKIT_MAX_PDS);
+        exit(EXIT_FAILURE);
+    }
+    check_not_group_id(from_process, ch);
+    check_not_group_id(to_process, peer_ch);
+
+    channel_t *channel = malloc(sizeof(channel_t));
+    if (channel == NULL) {
+        fprintf(stderr, "Error on allocating channel\n");
+        exit(EXIT_FAILURE);
+    }
+    channel->receiver = to_process;
+    channel->peer_ch = peer_ch;
+    channel->slot = NULL;
+    channel->ipc_buffer = to_process->call_buffers + peer_ch * IPC_BUFFER_SIZE;
+    channel->shared_ipc_buffer = 0;
+
     int ret;
     khiter_t channel_iter = kh_put(channel, from_process->channel_id_to_process, ch, &ret);
     if (ret == -1) {
@@ -151,7 +412,594 @@ void create_channel(process_t *from_process, process_t *to_process, microkit_cha
         exit(EXIT_FAILURE);
     }
     
-    kh_value(from_process->channel_id_to_process, channel_iter) = to_process;
+    kh_value(from_process->channel_id_to_process, channel_iter) = channel;
+}
+
+/**
+ * Selects how protected procedure calls from `from_process` along channel `ch` reach the receiver.
+ * Pipes are the default. The futex transport gives the sender a call slot inside the receiver's
+ * shared control block, so a call is a couple of futex operations instead of pipe reads and writes.
+ * 
+ * @param from_process Handle to the process making the calls
+ * @param ch An unsigned integer corresponding to the id of the channel in `from_process`
+ * @param transport One of PPC_TRANSPORT_PIPE or PPC_TRANSPORT_FUTEX
+ */
+void set_ppc_transport(process_t *from_process, microkit_channel ch, int transport) {
+    khiter_t it = kh_get(channel, from_process->channel_id_to_process, ch);
+    if (it == kh_end(from_process->channel_id_to_process)) {
+        fprintf(stderr, "Channel id %lu is not a valid channel\n", ch);
+        exit(EXIT_FAILURE);
+    }
+    channel_t *channel = kh_val(from_process->channel_id_to_process, it);
+
+    if (transport == PPC_TRANSPORT_PIPE) {
+        channel->slot = NULL;
+        return;
+    }
+    if (channel->slot != NULL) return;
+
+    process_t *receiver = channel->receiver;
+    if (receiver->num_fast_slots == MICROKIT_MAX_PDS) {
+        fprintf(stderr, "Too many futex channels into one protection domain (max %d)\n", MICROKIT_MAX_PDS);
+        exit(EXIT_FAILURE);
+    }
+    channel->slot = &receiver->control->slots[receiver->num_fast_slots++];
+    atomic_init(&channel->slot->state, PPC_SLOT_IDLE);
+    channel->slot->caller = from_process;
+    channel->slot->caller_ch = ch;
+}
+
+/**
+ * Lets the callers on both ends of a channel use the receiver's IPC buffer for the channel in place.
+ * A call then leaves its message registers in that buffer, where the caller sets them and the
+ * receiver reads them, instead of copying them in and the reply back out.
+ * 
+ * @param from_process Handle to the process at one end of the channel
+ * @param ch An unsigned integer corresponding to the id of the channel in `from_process`
+ */
+void set_channel_ipc_buffer(process_t *from_process, microkit_channel ch) {
+    khiter_t it = kh_get(channel, from_process->channel_id_to_process, ch);
+    if (it == kh_end(from_process->channel_id_to_process)) {
+        fprintf(stderr, "Channel id %lu is not a valid channel\n", ch);
+        exit(EXIT_FAILURE);
+    }
+    channel_t *channel = kh_val(from_process->channel_id_to_process, it);
+    channel->shared_ipc_buffer = 1;
+
+    process_t *receiver = channel->receiver;
+    it = kh_get(channel, receiver->channel_id_to_process, channel->peer_ch);
+    if (it != kh_end(receiver->channel_id_to_process)) {
+        kh_val(receiver->channel_id_to_process, it)->shared_ipc_buffer = 1;
+    }
+}
+
+/**
+ * Sets how many queued protected procedure calls the process serves from its pipe per wakeup
+ * before it looks at its other event sources again.
+ * 
+ * @param process Handle to the process
+ * @param budget The number of calls, at least 1
+ */
+void set_drain_budget(process_t *process, uint32_t budget) {
+    process->drain_budget = budget > 0 ? budget : 1;
+}
+
+/**
+ * Makes the event loop of the process spin for work for up to `poll_us` before it blocks in epoll,
+ * trading a busy CPU for not having to be woken up. The window adapts to how often spinning pays off.
+ * 
+ * @param process Handle to the process
+ * @param poll_us The longest spin in microseconds, or 0 to always block
+ */
+void set_poll(process_t *process, uint32_t poll_us) {
+    process->poll_ns = (uint64_t) poll_us * 1000;
+}
+
+/**
+ * Adds a member to a notification group of the sender, creating the group on its first member.
+ * 
+ * @param sender Handle to the process that notifies the group
+ * @param group The id the sender knows the group by
+ * @param member Handle to the process being added
+ * @param member_ch The id the member is notified on
+ */
+void add_group_member(process_t *sender, microkit_channel group, process_t *member, microkit_channel member_ch) {
+    if (group >= MICROKIT_MAX_PDS || member_ch >= MICROKIT_MAX_PDS) {
+        fprintf(stderr, "Notification group ids must be less than %d\n", MICROKIT_MAX_PDS);
+        exit(EXIT_FAILURE);
+    }
+    // Notifications arrive as bits indexed by id, so the member could not tell who notified it
+    if (kh_get(channel, member->channel_id_to_process, member_ch) != kh_end(member->channel_id_to_process) ||
+        member->group_ids & (1ull << member_ch)) {
+        fprintf(stderr, "Protection domain %s is notified by a group on id %lu, which it already uses\n",
+                member->name, member_ch);
+        exit(EXIT_FAILURE);
+    }
+    member->group_ids |= 1ull << member_ch;
+
+    notification_group_t *members = sender->groups[group];
+    if (members == NULL) {
+        members = calloc(1, sizeof(notification_group_t));
+        sender->groups[group] = members;
+    }
+
+    // A domain in the group under several ids is still woken once
+    for (int i = 0; i < members->num_members; ++i) {
+        if (members->members[i].receiver == member) {
+            members->members[i].bits |= 1ull << member_ch;
+            return;
+        }
+    }
+    members->members = realloc(members->members, (members->num_members + 1) * sizeof(group_member_t));
+    if (members->members == NULL) {
+        fprintf(stderr, "Error on allocating notification group of %s\n", sender->name);
+        exit(EXIT_FAILURE);
+    }
+    members->members[members->num_members++] = (group_member_t){.receiver = member, .bits = 1ull << member_ch};
+}
+
+/**
+ * Selects how the event loop of the process waits for and collects its events.
+ * 
+ * @param process Handle to the process
+ * @param event_loop EVENT_LOOP_EPOLL, EVENT_LOOP_IO_URING or EVENT_LOOP_IO_URING_SQPOLL
+ */
+void set_event_loop(process_t *process, int event_loop) {
+    if (event_loop != EVENT_LOOP_EPOLL && !MICROKIT_IO_URING) {
+        fprintf(stderr, "Protection domain %s wants the io_uring event loop, which this build leaves out\n",
+                process->name);
+        exit(EXIT_FAILURE);
+    }
+    process->event_loop = event_loop;
+}
+
+/**
+ * Makes every `microkit_notify` of the process deferred until the entry point it is made in returns,
+ * as if it were a `microkit_deferred_notify`.
+ * 
+ * @param process Handle to the process
+ */
+void set_deferred_notify(process_t *process) {
+    process->defer_notify = 1;
+}
+
+/**
+ * Builds a CPU set out of a list of CPU numbers.
+ * 
+ * @param cpus The CPU numbers. This is a Rust owned array.
+ * @param count The number of entries in `cpus`
+ * @param size Set to the size of the returned set, to be passed to the sched_*affinity calls
+ */
+static cpu_set_t *make_cpu_set(const uint32_t *cpus, uint32_t count, size_t *size) {
+    uint32_t max_cpu = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (cpus[i] > max_cpu) max_cpu = cpus[i];
+    }
+
+    cpu_set_t *set = CPU_ALLOC(max_cpu + 1);
+    if (set == NULL) {
+        fprintf(stderr, "Error on allocating CPU set\n");
+        exit(EXIT_FAILURE);
+    }
+    *size = CPU_ALLOC_SIZE(max_cpu + 1);
+    CPU_ZERO_S(*size, set);
+    for (uint32_t i = 0; i < count; ++i) {
+        CPU_SET_S(cpus[i], *size, set);
+    }
+    return set;
+}
+
+/**
+ * Restricts the process to the provided CPUs. It is applied to the child straight after clone.
+ * 
+ * @param process Handle to the process
+ * @param cpus The CPU numbers the process may run on, already checked to be online. This is a Rust owned array.
+ * @param count The number of entries in `cpus`, at least 1
+ */
+void set_affinity(process_t *process, const uint32_t *cpus, uint32_t count) {
+    if (process->affinity != NULL) CPU_FREE(process->affinity);
+    process->affinity = make_cpu_set(cpus, count, &process->affinity_size);
+}
+
+/**
+ * Applies the process's CPU affinity to its running child.
+ * 
+ * @param process Handle to the process, whose child must already be running
+ */
+static void apply_affinity(process_t *process) {
+    if (process->affinity == NULL) return;
+    if (sched_setaffinity(process->pid, process->affinity_size, process->affinity) == -1) {
+        fprintf(stderr, "Error on setting the CPU affinity of %s: %s\n", process->_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Restricts the calling loader thread, and any thread it creates afterwards, to the provided CPUs.
+ * Used to keep the loader off the cores of pinned protection domains, so must only be called once
+ * every child has been cloned.
+ * 
+ * @param cpus The CPU numbers the loader may run on. This is a Rust owned array.
+ * @param count The number of entries in `cpus`, at least 1
+ */
+void pin_loader(const uint32_t *cpus, uint32_t count) {
+    size_t size;
+    cpu_set_t *set = make_cpu_set(cpus, count, &size);
+    if (sched_setaffinity(0, size, set) == -1) {
+        fprintf(stderr, "Error on setting the CPU affinity of the loader: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    CPU_FREE(set);
+}
+
+/**
+ * Sets the seL4 Microkit priority of the process. It is applied to the child once it is running.
+ * 
+ * @param process Handle to the process
+ * @param priority A priority between 0 and MICROKIT_MAX_PRIORITY, higher being more urgent
+ */
+void set_priority(process_t *process, uint8_t priority) {
+    if (priority > MICROKIT_MAX_PRIORITY) {
+        fprintf(stderr, "Priority %u is above the maximum of %d\n", priority, MICROKIT_MAX_PRIORITY);
+        exit(EXIT_FAILURE);
+    }
+    process->priority = priority;
+}
+
+/**
+ * Applies the process's priority to its running child. The seL4 priority range is spread across
+ * the SCHED_RR real-time priorities, which like seL4 round-robin between equal priorities. Without
+ * CAP_SYS_NICE that is refused, so we fall back to the nice level in the same relative position
+ * and, failing that too, leave the child at the default policy.
+ * 
+ * @param process Handle to the process, whose child must already be running
+ */
+static void apply_priority(process_t *process) {
+    if (process->priority == PRIORITY_UNSET) return;
+
+    int min_rt = sched_get_priority_min(SCHED_RR);
+    int max_rt = sched_get_priority_max(SCHED_RR);
+    struct sched_param param = {
+        .sched_priority = min_rt + process->priority * (max_rt - min_rt) / MICROKIT_MAX_PRIORITY
+    };
+    if (sched_setscheduler(process->pid, SCHED_RR, &param) == 0) return;
+    if (errno != EPERM) {
+        fprintf(stderr, "Error on setting the scheduling policy of %s\n", process->_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Priority 0 maps to nice 19 and MICROKIT_MAX_PRIORITY to nice -20
+    int nice = 19 - process->priority * 39 / MICROKIT_MAX_PRIORITY;
+    if (setpriority(PRIO_PROCESS, process->pid, nice) == 0) {
+        fprintf(stderr, "Warning: no permission for real-time scheduling, running %s at nice %d instead\n",
+                process->_path, nice);
+        return;
+    }
+    fprintf(stderr, "Warning: no permission to change the priority of %s, running it at the default priority\n",
+            process->_path);
+}
+
+/**
+ * Gives the process a CPU budget per period, as the seL4 Microkit `budget` and `period` attributes do.
+ * A budget that covers the whole period is no limit at all, so nothing is enforced for it, and it
+ * replaces any budget given before.
+ * 
+ * @param process Handle to the process
+ * @param budget_us The CPU time the process may use per period, in microseconds
+ * @param period_us The length of a period, in microseconds
+ */
+void set_budget(process_t *process, uint64_t budget_us, uint64_t period_us) {
+    if (budget_us == 0 || budget_us > period_us) {
+        fprintf(stderr, "Budget must be non-zero and no larger than the period\n");
+        exit(EXIT_FAILURE);
+    }
+    int budgeted = process->budget.period_ns != 0;
+    if (budget_us == period_us) {
+        // Clears a budget given earlier
+        process->budget.budget_ns = 0;
+        process->budget.period_ns = 0;
+        for (int i = 0; budgeted && i < num_budgeted_processes; ++i) {
+            if (budgeted_processes[i] == process) {
+                budgeted_processes[i] = budgeted_processes[--num_budgeted_processes];
+                break;
+            }
+        }
+        return;
+    }
+
+    process->budget.budget_ns = budget_us * 1000;
+    process->budget.period_ns = period_us * 1000;
+    if (budgeted) return;
+
+    process_t **grown = realloc(budgeted_processes, (num_budgeted_processes + 1) * sizeof(process_t *));
+    if (grown == NULL) {
+        fprintf(stderr, "Error on allocating the budget monitor's process list\n");
+        exit(EXIT_FAILURE);
+    }
+    budgeted_processes = grown;
+    budgeted_processes[num_budgeted_processes++] = process;
+}
+
+/**
+ * Returns the current time of the provided clock in nanoseconds, or 0 if it cannot be read.
+ * 
+ * @param clock The clock to read
+ */
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) == -1) return 0;
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Applies the process's CPU budget to its running child. SCHED_DEADLINE lets the kernel do the
+ * throttling, and reports overruns to the child with SIGXCPU. Where that is not permitted the
+ * budget is left to the loader's monitor thread, see `start_budget_monitor`.
+ * 
+ * @param process Handle to the process, whose child must already be running
+ */
+static void apply_budget(process_t *process) {
+    budget_t *budget = &process->budget;
+    if (budget->period_ns == 0) return;
+
+    struct deadline_attr attr = {
+        .size = sizeof(struct deadline_attr),
+        .sched_policy = SCHED_DEADLINE,
+        .sched_flags = SCHED_FLAG_DL_OVERRUN,
+        .sched_runtime = budget->budget_ns,
+        .sched_deadline = budget->period_ns,
+        .sched_period = budget->period_ns,
+    };
+    if (syscall(SYS_sched_setattr, process->pid, &attr, 0) == 0) {
+        budget->enforcement = BUDGET_DEADLINE;
+        return;
+    }
+
+    if (clock_getcpuclockid(process->pid, &budget->cpu_clock) != 0) {
+        fprintf(stderr, "Error on finding the CPU clock of %s\n", process->_path);
+        exit(EXIT_FAILURE);
+    }
+    budget->enforcement = BUDGET_MONITOR;
+    budget->period_start = clock_ns(CLOCK_MONOTONIC);
+    budget->period_cpu_start = clock_ns(budget->cpu_clock);
+    fprintf(stderr, "Warning: SCHED_DEADLINE is not available (%s), the loader will enforce the budget of %s\n",
+            strerror(errno), process->_path);
+}
+
+/**
+ * Checks one monitored process against its budget: a new period resumes it, and using up the
+ * budget within a period stops it until the next one.
+ * 
+ * @param budget The budget of the process
+ * @param pid The child running the process
+ * @param now The current monotonic time in nanoseconds
+ * @return The latest time at which the process has to be checked again
+ */
+static uint64_t check_budget(budget_t *budget, pid_t pid, uint64_t now) {
+    if (now >= budget->period_start + budget->period_ns) {
+        if (budget->throttled_since != 0) {
+            kill(pid, SIGCONT);
+            budget->throttled_ns += now - budget->throttled_since;
+            budget->throttled_since = 0;
+        }
+        // Stay in phase with the original periods, even if we woke up late
+        budget->period_start = now - (now - budget->period_start) % budget->period_ns;
+        budget->period_cpu_start = clock_ns(budget->cpu_clock);
+    }
+
+    uint64_t next_check = budget->period_start + budget->period_ns;
+    if (budget->throttled_since == 0) {
+        uint64_t used = clock_ns(budget->cpu_clock) - budget->period_cpu_start;
+        if (used >= budget->budget_ns) {
+            kill(pid, SIGSTOP);
+            budget->overruns++;
+            budget->throttled_since = now;
+        } else if (now + budget->budget_ns - used < next_check) {
+            // The child cannot use up what is left of its budget any sooner than this
+            next_check = now + budget->budget_ns - used;
+        }
+    }
+    return next_check;
+}
+
+/**
+ * The loader's budget monitor. It sleeps until the earliest moment a monitored process could run
+ * out of budget or start a new period, then checks all of them.
+ * 
+ * @param arg Unused
+ */
+static void *budget_monitor(void *arg) {
+    // Real-time domains would starve a monitor running under the default policy
+    struct sched_param param = {.sched_priority = sched_get_priority_max(SCHED_FIFO)};
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    while (atomic_load(&budget_monitor_running)) {
+        uint64_t now = clock_ns(CLOCK_MONOTONIC);
+        uint64_t wake = now + BUDGET_MONITOR_MAX_SLEEP_NS;
+        for (int i = 0; i < num_budgeted_processes; ++i) {
+            process_t *process = budgeted_processes[i];
+            if (process->budget.enforcement != BUDGET_MONITOR || process->pid == -1) continue;
+
+            uint64_t next_check = check_budget(&process->budget, process->pid, now);
+            if (next_check < wake) wake = next_check;
+        }
+        if (wake < now + BUDGET_MONITOR_MIN_SLEEP_NS) wake = now + BUDGET_MONITOR_MIN_SLEEP_NS;
+
+        struct timespec until = {.tv_sec = wake / 1000000000ull, .tv_nsec = wake % 1000000000ull};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+    }
+
+    // Account for throttling that is still going on, and let the children run again
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < num_budgeted_processes; ++i) {
+        budget_t *budget = &budgeted_processes[i]->budget;
+        if (budget->throttled_since == 0) continue;
+        budget->throttled_ns += now - budget->throttled_since;
+        budget->throttled_since = 0;
+        kill(budgeted_processes[i]->pid, SIGCONT);
+    }
+    return NULL;
+}
+
+/**
+ * Starts a thread of the loader with every signal blocked. The loader waits for SIGINT/SIGTERM
+ * with sigwait, so none of its other threads may ever take them.
+ * 
+ * @param thread Where to store the thread
+ * @param body What the thread runs
+ * @param name What the thread is, for the error message should it not start
+ */
+void start_loader_thread(pthread_t *thread, void *(*body)(void *), const char *name) {
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    int error = pthread_create(thread, NULL, body, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Error on starting the %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Starts the loader's budget monitor thread if any running process needs its budget enforced
+ * by the loader. Must be called after `run_process`.
+ */
+void start_budget_monitor(void) {
+    int needed = 0;
+    for (int i = 0; i < num_budgeted_processes; ++i) {
+        if (budgeted_processes[i]->budget.enforcement == BUDGET_MONITOR) needed = 1;
+    }
+    if (!needed || atomic_exchange(&budget_monitor_running, 1)) return;
+
+    start_loader_thread(&budget_monitor_thread, budget_monitor, "budget monitor");
+}
+
+/**
+ * Stops the loader's budget monitor thread, if it is running, resuming any throttled children.
+ */
+void stop_budget_monitor(void) {
+    if (!atomic_exchange(&budget_monitor_running, 0)) return;
+    pthread_join(budget_monitor_thread, NULL);
+}
+
+/**
+ * Makes the loader open every image before the processes running it are cloned. Each image is
+ * then relocated and bound once, with RTLD_NOW, and every process inherits it copy-on-write
+ * instead of opening it itself.
+ */
+void set_preload_images(void) {
+    preload = 1;
+}
+
+/**
+ * Opens an image in the loader, or finds it if another process runs it too.
+ * 
+ * @param path The path of the image
+ * @return The handle every process running the image inherits
+ */
+static void *preload_image(const char *path) {
+    for (int i = 0; i < num_preloaded_images; ++i) {
+        if (strcmp(preloaded_images[i].path, path) == 0) return preloaded_images[i].handle;
+    }
+
+    uint64_t start_ns = monotonic_ns();
+    void *handle = dlopen(path, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+    preload_ns += monotonic_ns() - start_ns;
+    char *real_path = realpath(path, NULL);
+
+    preloaded_image_t *grown = realloc(preloaded_images, (num_preloaded_images + 1) * sizeof(preloaded_image_t));
+    if (grown == NULL) {
+        fprintf(stderr, "Error on allocating the list of preloaded images\n");
+        exit(EXIT_FAILURE);
+    }
+    preloaded_images = grown;
+    preloaded_images[num_preloaded_images++] = (preloaded_image_t){.path = path, .real_path = real_path, .handle = handle};
+    return handle;
+}
+
+/**
+ * Gives a process its image path and, when images are preloaded, opens its image. Called for
+ * every process before the first is cloned, so that no child inherits an image opened after it.
+ * 
+ * @param process Handle to the process
+ * @param path A string corresponding to the path of the process. This is a Rust owned string.
+ */
+void preload_process_image(process_t *process, char *path) {
+    process->_path = path;
+    if (preload && process->image == NULL) {
+        process->image = preload_image(path);
+    }
+}
+
+/**
+ * Whether a mapping of the loader goes away in a child of the process before it maps its regions:
+ * the loader's views of the regions, and the images preloaded for other processes.
+ * @param process The process being checked
+ * @param start The start of the mapping
+ * @param end The end of the mapping
+ * @param path The file the mapping is of, or an empty string
+ */
+static int released_in_child(process_t *process, uintptr_t start, uintptr_t end, const char *path) {
+    for (int i = 0; i < num_shared_memory_regions; ++i) {
+        uintptr_t view = (uintptr_t) shared_memory_regions[i]->shared_buffer;
+        if (start >= view && end <= view + shared_memory_regions[i]->size) return 1;
+    }
+    for (int i = 0; i < num_preloaded_images; ++i) {
+        preloaded_image_t *image = &preloaded_images[i];
+        if (image->handle != process->image && image->real_path != NULL && strcmp(image->real_path, path) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checks that no region the process maps at a fixed address overlaps anything the process
+ * inherits from the loader, such as the loader's own code, heap, the stacks of the processes or
+ * a preloaded image. The child would otherwise fail to map the region once it is running.
+ * 
+ * @param process Handle to the process
+ */
+void check_fixed_addresses(process_t *process) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        fprintf(stderr, "Error on reading the mappings of the loader\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        uintptr_t start, end;
+        char path[PATH_MAX] = "";
+        if (sscanf(line, "%lx-%lx %*s %*s %*s %*s %4095[^\n]", &start, &end, path) < 2) continue;
+        if (released_in_child(process, start, end, path)) continue;
+
+        for (shared_memory_stack_t *curr = process->shared_memory; curr != NULL; curr = curr->next) {
+            uintptr_t from = (uintptr_t) curr->vaddr, to = from + curr->shm->size;
+            if (curr->vaddr == NULL || to <= start || end <= from) continue;
+            fprintf(stderr, "Domain %s maps a region at 0x%lx-0x%lx, which overlaps %s at 0x%lx-0x%lx inherited from the loader\n",
+                    process->name, from, to, path[0] != '\0' ? path : "an anonymous mapping", start, end);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(maps);
+}
+
+/**
+ * Closes the images the loader preloaded for other processes, so that their code and data do not
+ * linger in the current one and their addresses are free for its regions.
+ * 
+ * @param process The current process
+ */
+void release_preloaded_images(process_t *process) {
+    for (int i = 0; i < num_preloaded_images; ++i) {
+        if (preloaded_images[i].handle != process->image) dlclose(preloaded_images[i].handle);
+    }
 }
 
 /**
@@ -162,12 +1010,128 @@ void create_channel(process_t *from_process, process_t *to_process, microkit_cha
  * @param path A string corresponding to the path of the process. This is a Rust owned string.
  */
 void run_process(process_t *process, char *path) {
-    process->_path = path;
+    preload_process_image(process, path);
+    read_console(process);
+
+    uint64_t start_ns = monotonic_ns();
+    if (first_clone_ns == 0) first_clone_ns = start_ns;
     pid_t pid = clone(event_handler, process->stack_top, SIGCHLD, (void *) process);
+    clone_ns += monotonic_ns() - start_ns;
     if (pid == -1) {
         fprintf(stderr, "Error on cloning process %s\n", path);
         exit(EXIT_FAILURE);
     }
+    process->pid = pid;
+    apply_affinity(process);
+    apply_priority(process);
+    apply_budget(process);
+}
+
+/**
+ * Kills the child running the provided process, if there is one, and reaps it.
+ * 
+ * @param process Handle to the process to stop
+ */
+void stop_process(process_t *process) {
+    if (process->pid == -1) return;
+    kill(process->pid, SIGKILL);
+    waitpid(process->pid, NULL, 0);
+    process->pid = -1;
+}
+
+/**
+ * Prints the event loop counters of the provided process.
+ * 
+ * @param process Handle to the process
+ * @param name The name of the protection domain (process). This is a Rust owned string.
+ */
+void print_process_stats(process_t *process, const char *name) {
+    pd_stats_t *stats = &process->control->stats;
+    uint64_t events = stats->notifications + stats->ppcs;
+    uint64_t max_events = stats->wakeup_events > stats->max_wakeup_events ? stats->wakeup_events : stats->max_wakeup_events;
+
+    printf("%s: %lu wakeups, %lu notifications, %lu ppcs, %.2f events/wakeup (max %lu), drain budget hit %lu times\n",
+           name, stats->wakeups, stats->notifications, stats->ppcs,
+           stats->wakeups > 0 ? (double) events / stats->wakeups : 0.0, max_events, stats->budget_exhausted);
+
+    static const char *event_loops[] = {
+        [EVENT_LOOP_EPOLL] = "epoll", [EVENT_LOOP_IO_URING] = "io_uring", [EVENT_LOOP_IO_URING_SQPOLL] = "io_uring with SQPOLL",
+    };
+    printf("%s: %s event loop made %lu system calls, %.2f per event\n", name, event_loops[process->event_loop],
+           stats->syscalls, events > 0 ? (double) stats->syscalls / events : 0.0);
+    if (stats->notifications_sent > 0) {
+        printf("%s: sent %lu notifications (%lu deferred) with %lu eventfd writes\n", name,
+               stats->notifications_sent, stats->notifications_deferred, stats->notify_writes);
+    }
+
+    if (process->poll_ns > 0) {
+        uint64_t polls = stats->poll_hits + stats->poll_sleeps;
+        printf("%s: busy polled %lu times for up to %lu us, %lu found work (%.1f%%) and %lu slept, "
+               "%.3f ms spinning, window now %lu us\n",
+               name, polls, process->poll_ns / 1000, stats->poll_hits,
+               polls > 0 ? 100.0 * stats->poll_hits / polls : 0.0, stats->poll_sleeps,
+               stats->poll_spin_ns / 1e6, stats->poll_window_ns / 1000);
+    }
+
+    budget_t *budget = &process->budget;
+    if (budget->enforcement == BUDGET_DEADLINE) {
+        printf("%s: budget %lu us per %lu us enforced by SCHED_DEADLINE, %lu overruns\n",
+               name, budget->budget_ns / 1000, budget->period_ns / 1000, stats->deadline_overruns);
+    } else if (budget->enforcement == BUDGET_MONITOR) {
+        printf("%s: budget %lu us per %lu us enforced by the loader, %lu overruns, throttled for %.3f ms\n",
+               name, budget->budget_ns / 1000, budget->period_ns / 1000, budget->overruns,
+               budget->throttled_ns / 1e6);
+    }
+}
+
+/**
+ * Prints how long each phase of starting the system took, from parsing the .system file to the
+ * last `init` returning, so that options such as preloading can be compared.
+ * 
+ * @param processes Handles to the processes
+ * @param count The number of processes
+ * @param parse_ns How long the loader took to parse the .system file
+ * @param regions_ns How long it took to create and map the memory regions
+ */
+void print_startup_timings(process_t **processes, int count, uint64_t parse_ns, uint64_t regions_ns) {
+    uint64_t load_ns = 0, max_load_ns = 0, init_ns = 0, max_init_ns = 0, last_ready_ns = 0;
+    int loaded = 0, ready = 0;
+    for (int i = 0; i < count; ++i) {
+        pd_startup_t *startup = &processes[i]->control->startup;
+        if (startup->loaded_ns == 0) continue;
+        uint64_t load = startup->loaded_ns - startup->started_ns;
+        load_ns += load;
+        if (load > max_load_ns) max_load_ns = load;
+        loaded++;
+
+        if (startup->ready_ns == 0) continue;
+        uint64_t init = startup->ready_ns - startup->init_ns;
+        init_ns += init;
+        if (init > max_init_ns) max_init_ns = init;
+        if (startup->ready_ns > last_ready_ns) last_ready_ns = startup->ready_ns;
+        ready++;
+    }
+
+    printf("Startup: parsed the system in %.3f ms, mapped its regions in %.3f ms, ", parse_ns / 1e6, regions_ns / 1e6);
+    if (preload) {
+        printf("preloaded %d images in %.3f ms, ", num_preloaded_images, preload_ns / 1e6);
+    }
+    printf("cloned %d domains in %.3f ms\n", count, clone_ns / 1e6);
+    if (loaded == 0) return;
+
+    printf("Startup: domains %s their images in %.3f ms on average (%.3f ms at most)", preload ? "took over" : "loaded",
+           load_ns / (loaded * 1e6), max_load_ns / 1e6);
+    if (ready > 0) {
+        printf(", ran init in %.3f ms on average (%.3f ms at most), and were ready %.3f ms after the first clone",
+               init_ns / (ready * 1e6), max_init_ns / 1e6, (last_ready_ns - first_clone_ns) / 1e6);
+    }
+    if (loaded < count) {
+        printf(" (%d still loading)", count - loaded);
+    }
+    if (ready < loaded) {
+        printf(" (%d still in init)", loaded - ready);
+    }
+    printf("\n");
 }
 
 /**
@@ -179,5 +1143,18 @@ void run_process(process_t *process, char *path) {
 process_t *get_channel_target(process_t *from, microkit_channel ch) {
     khiter_t it = kh_get(channel, from->channel_id_to_process, ch);
     if (it == kh_end(from->channel_id_to_process)) return NULL;
-    return kh_val(from->channel_id_to_process, it);
+    return kh_val(from->channel_id_to_process, it)->receiver;
+}
+
+/**
+ * Used purely for testing purposes by `tests/loader_test.rs`.
+ * 
+ * @param from The process to get the channel mapping from
+ * @param ch The channel whose IPC buffer flag we return
+ * @return Whether calls along the channel use the receiver's IPC buffer in place, or -1 if there is no such channel
+ */
+int get_channel_shared(process_t *from, microkit_channel ch) {
+    khiter_t it = kh_get(channel, from->channel_id_to_process, ch);
+    if (it == kh_end(from->channel_id_to_process)) return -1;
+    return kh_val(from->channel_id_to_process, it)->shared_ipc_buffer;
 }
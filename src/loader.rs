@@ -1,36 +1,153 @@
+pub mod topology;
+
 use std::ffi::CString;
 use std::collections::HashMap;
+use std::time::Duration;
 use std::os::raw::{c_char, c_int, c_void};
 
 unsafe extern "C" {
-    fn create_shared_memory(name: *const libc::c_char, size: libc::c_ulong) -> *mut libc::c_void;
+    fn create_shared_memory(name: *const libc::c_char, size: libc::c_ulong, page_size: libc::c_ulong) -> *mut libc::c_void;
     fn create_process(name: *const libc::c_char, stack_size: libc::c_uint) -> *mut libc::c_void;
-    fn add_shared_memory(process: *mut libc::c_void, memory: *mut libc::c_void, varname: *const libc::c_char);
-    fn create_channel(process1: *mut libc::c_void, process2: *mut libc::c_void, id: libc::c_ulong);
+    fn add_shared_memory(process: *mut libc::c_void, memory: *mut libc::c_void, varname: *const libc::c_char, vaddr: u64, prot: c_int);
+    fn create_channel(process1: *mut libc::c_void, process2: *mut libc::c_void, id: libc::c_ulong, peer_id: libc::c_ulong);
+    fn set_ppc_transport(process: *mut libc::c_void, id: libc::c_ulong, transport: libc::c_int);
+    fn set_channel_ipc_buffer(process: *mut libc::c_void, id: libc::c_ulong);
+    fn set_drain_budget(process: *mut libc::c_void, budget: libc::c_uint);
+    fn set_poll(process: *mut libc::c_void, poll_us: u32);
+    fn set_event_loop(process: *mut libc::c_void, event_loop: c_int);
+    fn set_deferred_notify(process: *mut libc::c_void);
+    fn add_group_member(sender: *mut libc::c_void, group: u64, member: *mut libc::c_void, member_id: u64);
+    fn set_memory_policy(process: *mut libc::c_void, policy: c_int);
+    fn set_shared_memory_policy(shm: *mut libc::c_void, name: *const libc::c_char, policy: c_int);
+    fn set_priority(process: *mut libc::c_void, priority: u8);
+    fn set_affinity(process: *mut libc::c_void, cpus: *const u32, count: u32);
+    fn pin_loader(cpus: *const u32, count: u32);
+    fn set_budget(process: *mut libc::c_void, budget_us: u64, period_us: u64);
+    fn open_trace(path: *const libc::c_char);
+    fn trace_process(process: *mut libc::c_void);
+    fn start_trace_writer();
+    fn stop_trace_writer();
+    fn start_console_writer();
+    fn stop_console_writer();
+    fn enable_latency_stats(processes: *const ProcessHandle, count: c_int);
+    fn print_latency_stats(path: *const libc::c_char);
+    fn start_budget_monitor();
+    fn stop_budget_monitor();
+    fn set_preload_images();
+    fn preload_process_image(process: *mut libc::c_void, image_path: *mut libc::c_char);
+    fn check_fixed_addresses(process: *mut libc::c_void);
     fn run_process(process: *mut libc::c_void, image_path: *mut libc::c_char);
+    fn stop_process(process: *mut libc::c_void);
+    fn print_process_stats(process: *mut libc::c_void, name: *const libc::c_char);
+    fn print_startup_timings(processes: *const ProcessHandle, count: c_int, parse_ns: u64, regions_ns: u64);
     fn get_channel_target(from: ProcessHandle, ch: u64) -> ProcessHandle;
+    fn get_channel_shared(from: ProcessHandle, ch: u64) -> c_int;
 }
 
 pub type ProcessHandle = *mut libc::c_void;
 pub type SharedMemoryHandle = *mut libc::c_void;
 
+/// How protected procedure calls travel across a channel. Must match PPC_TRANSPORT_* in handler.h.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum PpcTransport {
+    Pipe = 0,
+    Futex = 1,
+}
+
 
 #[repr(C)]
 pub struct SharedMemory {
     pub shared_buffer: *mut c_void,
     pub size: u64,
+    pub page_size: u64,
+    pub backing: c_int,
+    pub memory_policy: c_int,
+    pub fd: c_int,
 }
 
+/// A domain notified by a notification group. Must match struct group_member in handler.h.
+#[repr(C)]
+pub struct GroupMember {
+    pub receiver: ProcessHandle,
+    pub bits: u64,
+}
+
+/// The domains one domain notifies together. Must match struct notification_group in handler.h.
+#[repr(C)]
+pub struct NotificationGroup {
+    pub num_members: c_int,
+    pub members: *mut GroupMember,
+}
+
+/// Bytes in the debug console ring of a process. Must match CONSOLE_RING_BYTES in handler.h.
+pub const CONSOLE_RING_BYTES: usize = 65536;
+
+/// The debug console ring of a process. Must match struct console_ring in handler.h.
+#[repr(C, align(64))]
+pub struct ConsoleRing {
+    pub head: u64,
+    _head_line: [u8; 56],
+    pub tail: u64,
+    pub dropped: u64,
+    pub line_open: c_int,
+    pub data: [u8; CONSOLE_RING_BYTES],
+}
+
+/// Page sizes a memory region may ask for. Must match PAGE_SIZE, LARGE_PAGE_SIZE and HUGE_PAGE_SIZE in handler.h.
+pub const SMALL_PAGE: u64 = 0x1000;
+pub const LARGE_PAGE: u64 = 0x200000;
+pub const HUGE_PAGE: u64 = 0x40000000;
+
+/// Flags saying whether memory is populated up front and locked. Must match enum memory_policy in handler.h.
+pub const MEMORY_PREFAULT: c_int = 1 << 0;
+pub const MEMORY_LOCK: c_int = 1 << 1;
+
+/// What a memory region ended up backed by. Must match enum shared_memory_backing in handler.h.
+pub const BACKING_SMALL_PAGES: c_int = 0;
+pub const BACKING_HUGETLB: c_int = 1;
+pub const BACKING_TRANSPARENT: c_int = 2;
+
+/// How the event loop of a protection domain waits for its events. Must match enum event_loop in handler.h.
+pub const EVENT_LOOP_EPOLL: c_int = 0;
+pub const EVENT_LOOP_IO_URING: c_int = 1;
+pub const EVENT_LOOP_IO_URING_SQPOLL: c_int = 2;
+
 #[repr(C)]
 pub struct SharedMemoryStackNode {
     pub shm: *mut c_void,
     pub _varname: *const c_char,
     pub next: *mut SharedMemoryStackNode,
+    pub vaddr: *mut c_void,
+    pub prot: c_int,
+    pub mapped: *mut c_void,
+}
+
+#[repr(C)]
+pub struct EntryPoints {
+    pub init:      *mut c_void,
+    pub notified:  *mut c_void,
+    pub protected: *mut c_void,
+    pub replied:   *mut c_void,
+}
+
+#[repr(C)]
+pub struct Budget {
+    pub budget_ns:        u64,
+    pub period_ns:        u64,
+    pub enforcement:      c_int,
+    pub cpu_clock:        libc::clockid_t,
+    pub period_start:     u64,
+    pub period_cpu_start: u64,
+    pub throttled_since:  u64,
+    pub overruns:         u64,
+    pub throttled_ns:     u64,
 }
 
 #[repr(C)]
 pub struct Process {
     pub _path:                 *mut c_char,
+    pub image:                 *mut c_void,
     pub stack_top:             *mut c_char,
     pub sig_handler_stack:     *mut c_char,
     pub shared_memory:         *mut SharedMemoryStackNode,
@@ -39,17 +156,48 @@ pub struct Process {
     pub send_pipe:             [c_int; 2],
     pub receive_pipe:          [c_int; 2],
     pub ipc_buffer:            *mut c_void,
+    pub mrs:                   *mut c_void,
+    pub call_buffers:          *mut u64,
+    pub entry:                 EntryPoints,
+    pub control:               *mut c_void,
+    pub ppc_doorbell:          c_int,
+    pub num_fast_slots:        c_int,
+    pub drain_budget:          libc::c_uint,
+    pub poll_ns:               u64,
+    pub poll_history:          u32,
+    pub event_loop:            c_int,
+    pub defer_notify:          c_int,
+    pub deferred_notify:       u64,
+    pub groups:                [*mut c_void; 63],
+    pub group_ids:             u64,
+    pub priority:              c_int,
+    pub pid:                   libc::pid_t,
+    pub budget:                Budget,
+    pub affinity:              *mut c_void,
+    pub affinity_size:         usize,
+    pub name:                  *mut c_char,
+    pub trace:                 *mut c_void,
+    pub console:               *mut c_void,
+    pub latency:               *mut c_void,
+    pub stack_size:            u32,
+    pub memory_policy:         c_int,
+    pub async_calls:           u64,
+    pub async_start_ns:        [u64; 63],
 }
 
 pub struct ProcessInfo {
     pub handle: ProcessHandle,
     pub image_path: String,
+    pub priority: Option<u8>,
+    pub cpus: Vec<u32>,
 }
 
 pub struct Loader<> {
     // Rust maintains the mappings during setup
     pub processes: HashMap<String, ProcessInfo>,
     pub shared_memory: HashMap<String, SharedMemoryHandle>,
+    pub loader_cpus: Option<Vec<u32>>,
+    pub latency_stats: bool,
 }
 
 impl<> Loader<> {
@@ -57,14 +205,21 @@ impl<> Loader<> {
         Self {
             processes:            HashMap::new(),
             shared_memory:        HashMap::new(),
+            loader_cpus:          None,
+            latency_stats:        false,
         }
     }
 
     pub fn create_shared_memory(&mut self, name: &str, size: u64) {
+        self.create_shared_memory_with_page_size(name, size, SMALL_PAGE);
+    }
+
+    /// Creates a memory region backed by pages of `page_size` bytes where the system allows it.
+    pub fn create_shared_memory_with_page_size(&mut self, name: &str, size: u64, page_size: u64) {
         let name_c = CString::new(name)
             .unwrap_or_else(|_| panic!("Shared memory name {:?} contains an internal null byte", name));
         
-        let handle = unsafe { create_shared_memory(name_c.as_ptr(), size) };
+        let handle = unsafe { create_shared_memory(name_c.as_ptr(), size, page_size) };
         
         self.shared_memory.insert(name.to_string(), handle);
     }
@@ -78,6 +233,8 @@ impl<> Loader<> {
         self.processes.insert(name.to_string(), ProcessInfo {
             handle,
             image_path: String::new(), // Will be set later
+            priority: None,
+            cpus: Vec::new(),
         });
         
         handle
@@ -90,6 +247,12 @@ impl<> Loader<> {
     }
 
     pub fn add_shared_memory(&mut self, pd_name: &str, mr_name: &str, varname: &str) {
+        self.map_shared_memory(pd_name, mr_name, 0, libc::PROT_READ | libc::PROT_WRITE, Some(varname));
+    }
+
+    /// Maps a region into a protection domain at `vaddr` (0 for anywhere) with the given PROT_* flags,
+    /// optionally pointing the variable `varname` in its image at the mapping.
+    pub fn map_shared_memory(&mut self, pd_name: &str, mr_name: &str, vaddr: u64, prot: c_int, varname: Option<&str>) {
         let process_handle = self.processes.get(pd_name)
             .unwrap_or_else(|| panic!("Process {} not found", pd_name))
             .handle;
@@ -97,13 +260,26 @@ impl<> Loader<> {
         let shm_handle = self.shared_memory.get(mr_name)
             .unwrap_or_else(|| panic!("Shared memory {} not found", mr_name));
         
-        let var_ptr = CString::new(varname)
-            .unwrap_or_else(|_| panic!("Variable name {:?} contains an internal null byte", varname)).into_raw();
+        let var_ptr = match varname {
+            Some(varname) => CString::new(varname)
+                .unwrap_or_else(|_| panic!("Variable name {:?} contains an internal null byte", varname)).into_raw(),
+            None => std::ptr::null_mut(),
+        };
         
-        unsafe { add_shared_memory(process_handle, *shm_handle, var_ptr); }
+        unsafe { add_shared_memory(process_handle, *shm_handle, var_ptr, vaddr, prot); }
     }
 
     pub fn create_channel(&mut self, pd1: &str, pd2: &str, id: u64) {
+        self.create_channel_end(pd1, pd2, id, id);
+    }
+
+    // Creates both ends of a <channel>, each side knowing the channel by its own id
+    pub fn connect_channel(&mut self, pd1: &str, id1: u64, pd2: &str, id2: u64) {
+        self.create_channel_end(pd1, pd2, id1, id2);
+        self.create_channel_end(pd2, pd1, id2, id1);
+    }
+
+    fn create_channel_end(&mut self, pd1: &str, pd2: &str, id: u64, peer_id: u64) {
         let process1_handle = self.processes.get(pd1)
             .unwrap_or_else(|| panic!("Process {} not found", pd1))
             .handle;
@@ -112,7 +288,131 @@ impl<> Loader<> {
             .unwrap_or_else(|| panic!("Process {} not found", pd2))
             .handle;
         
-        unsafe { create_channel(process1_handle, process2_handle, id); }
+        unsafe { create_channel(process1_handle, process2_handle, id, peer_id); }
+    }
+
+    pub fn set_ppc_transport(&mut self, pd_name: &str, id: u64, transport: PpcTransport) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_ppc_transport(process_handle, id, transport as c_int); }
+    }
+
+    /// Lets callers on both ends of the channel `id` of a protection domain use the receiver's IPC buffer in place, so calls copy nothing.
+    pub fn set_channel_ipc_buffer(&mut self, pd_name: &str, id: u64) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_channel_ipc_buffer(process_handle, id); }
+    }
+
+    pub fn set_drain_budget(&mut self, pd_name: &str, budget: u32) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_drain_budget(process_handle, budget); }
+    }
+
+    /// Makes a protection domain busy poll for up to `poll_us` microseconds before its event loop blocks.
+    pub fn set_poll(&mut self, pd_name: &str, poll_us: u32) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_poll(process_handle, poll_us); }
+    }
+
+    /// Selects how the event loop of a protection domain waits for its events, one of the `EVENT_LOOP_*` constants.
+    pub fn set_event_loop(&mut self, pd_name: &str, event_loop: c_int) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_event_loop(process_handle, event_loop); }
+    }
+
+    /// Makes every notification a protection domain sends wait until the entry point it is sent from returns.
+    pub fn set_deferred_notify(&mut self, pd_name: &str) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_deferred_notify(process_handle); }
+    }
+
+    /// Adds `member` to the notification group `group` of `sender`, to be notified on its id `member_id`.
+    pub fn add_group_member(&mut self, sender: &str, group: u64, member: &str, member_id: u64) {
+        let sender_handle = self.processes.get(sender)
+            .unwrap_or_else(|| panic!("Process {} not found", sender))
+            .handle;
+
+        let member_handle = self.processes.get(member)
+            .unwrap_or_else(|| panic!("Process {} not found", member))
+            .handle;
+
+        unsafe { add_group_member(sender_handle, group, member_handle, member_id); }
+    }
+
+    /// Prefaults and optionally locks the stacks, IPC buffer and control block of a protection domain before its `init`.
+    pub fn set_memory_policy(&mut self, pd_name: &str, policy: c_int) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_memory_policy(process_handle, policy); }
+    }
+
+    /// Populates and optionally locks a memory region now, and in every protection domain that maps it before its `init`.
+    pub fn set_shared_memory_policy(&mut self, name: &str, policy: c_int) {
+        let handle = *self.shared_memory.get(name)
+            .unwrap_or_else(|| panic!("Shared memory {} not found", name));
+        let name_c = CString::new(name).unwrap();
+
+        unsafe { set_shared_memory_policy(handle, name_c.as_ptr(), policy); }
+    }
+
+    pub fn set_priority(&mut self, pd_name: &str, priority: u8) {
+        let process = self.processes.get_mut(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name));
+
+        process.priority = Some(priority);
+        unsafe { set_priority(process.handle, priority); }
+    }
+
+    pub fn set_affinity(&mut self, pd_name: &str, cpus: Vec<u32>) {
+        let process = self.processes.get_mut(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name));
+
+        if cpus.is_empty() {
+            panic!("Process {} must be allowed at least one CPU", pd_name);
+        }
+        unsafe { set_affinity(process.handle, cpus.as_ptr(), cpus.len() as u32); }
+        process.cpus = cpus;
+    }
+
+    // The loader itself is only pinned once every protection domain has been cloned
+    pub fn set_loader_cpus(&mut self, cpus: Vec<u32>) {
+        if cpus.is_empty() {
+            panic!("The loader must be allowed at least one CPU");
+        }
+        self.loader_cpus = Some(cpus);
+    }
+
+    pub fn set_budget(&mut self, pd_name: &str, budget_us: u64, period_us: u64) {
+        let process_handle = self.processes.get(pd_name)
+            .unwrap_or_else(|| panic!("Process {} not found", pd_name))
+            .handle;
+
+        unsafe { set_budget(process_handle, budget_us, period_us); }
+    }
+
+    /// Makes the loader open each distinct image once, with every symbol bound, before cloning the
+    /// protection domains that run it, so that they inherit it rather than each opening it.
+    pub fn set_preload_images(&mut self) {
+        unsafe { set_preload_images(); }
     }
 
     pub fn run_process(&mut self, pd_name: &str) {
@@ -125,13 +425,101 @@ impl<> Loader<> {
         unsafe { run_process(process.handle, image_path_ptr); }
     }
 
+    /// Opens the image of every process before any is cloned, so that no child inherits the image
+    /// of a process started after it, then checks the fixed region addresses against everything
+    /// the children inherit from the loader.
+    pub fn preload_images(&mut self) {
+        for process in self.processes.values() {
+            let image_path_ptr = CString::new(process.image_path.as_str())
+                .unwrap_or_else(|_| panic!("Image path {:?} contains an internal null byte", process.image_path)).into_raw();
+            unsafe { preload_process_image(process.handle, image_path_ptr); }
+        }
+        for process in self.processes.values() {
+            unsafe { check_fixed_addresses(process.handle); }
+        }
+    }
+
     pub fn run_all_processes(&mut self) {
         // Clone the keys to avoid borrowing issues
         let process_names: Vec<String> = self.processes.keys().cloned().collect();
         
+        self.preload_images();
         for process_name in process_names {
             self.run_process(&process_name);
         }
+
+        // Children inherit the loader's affinity, so the loader can only move away from them now
+        if let Some(cpus) = &self.loader_cpus {
+            unsafe { pin_loader(cpus.as_ptr(), cpus.len() as u32); }
+        }
+
+        // Budgets SCHED_DEADLINE could not take on are enforced from the loader
+        unsafe { start_budget_monitor(); }
+        unsafe { start_trace_writer(); }
+        unsafe { start_console_writer(); }
+    }
+
+    pub fn stop_all_processes(&mut self) {
+        unsafe { stop_budget_monitor(); }
+        for process in self.processes.values() {
+            unsafe { stop_process(process.handle); }
+        }
+        unsafe { stop_trace_writer(); }
+        unsafe { stop_console_writer(); }
+    }
+
+    /// Records the latency of every protected call and notification in histograms. Must be called
+    /// once every channel has been created, and before the protection domains run.
+    pub fn enable_latency_stats(&mut self) {
+        let mut names: Vec<&String> = self.processes.keys().collect();
+        names.sort();
+        let handles: Vec<ProcessHandle> = names.iter().map(|name| self.processes[*name].handle).collect();
+
+        unsafe { enable_latency_stats(handles.as_ptr(), handles.len() as c_int); }
+        self.latency_stats = true;
+    }
+
+    /// Prints p50/p99/p99.9/max per channel to stdout, or overwrites `path` with them.
+    pub fn print_latency_stats(&self, path: Option<&str>) {
+        if !self.latency_stats { return; }
+        match path {
+            Some(path) => {
+                let path_c = CString::new(path)
+                    .unwrap_or_else(|_| panic!("Path {:?} contains an internal null byte", path));
+                unsafe { print_latency_stats(path_c.as_ptr()); }
+            }
+            None => unsafe { print_latency_stats(std::ptr::null()) },
+        }
+    }
+
+    /// Traces every protection domain into a Chrome JSON trace at `path`. Must be called before they run.
+    pub fn enable_tracing(&mut self, path: &str) {
+        let path_ptr = CString::new(path)
+            .unwrap_or_else(|_| panic!("Trace path {:?} contains an internal null byte", path)).into_raw();
+        unsafe { open_trace(path_ptr); }
+
+        for process in self.processes.values() {
+            unsafe { trace_process(process.handle); }
+        }
+    }
+
+    pub fn print_stats(&self) {
+        let mut process_names: Vec<&String> = self.processes.keys().collect();
+        process_names.sort();
+
+        for process_name in process_names {
+            let name_c = CString::new(process_name.as_str())
+                .unwrap_or_else(|_| panic!("Process name {:?} contains an internal null byte", process_name));
+            unsafe { print_process_stats(self.processes[process_name].handle, name_c.as_ptr()); }
+        }
+    }
+
+    /// Prints how long each phase of startup took, given how long parsing the .system file and mapping its regions took.
+    pub fn print_startup_timings(&self, parse: Duration, regions: Duration) {
+        let handles: Vec<ProcessHandle> = self.processes.values().map(|p| p.handle).collect();
+        unsafe {
+            print_startup_timings(handles.as_ptr(), handles.len() as c_int, parse.as_nanos() as u64, regions.as_nanos() as u64);
+        }
     }
 
     // Used purely for testing purposes
@@ -144,4 +532,13 @@ impl<> Loader<> {
             Some(target)
         }
     }
+
+    // Used purely for testing purposes
+    pub fn get_channel_shared(&self, from_process: &str, channel_id: u64) -> Option<bool> {
+        let from = self.processes.get(from_process)?.handle;
+        match unsafe { get_channel_shared(from, channel_id) } {
+            -1 => None,
+            shared => Some(shared != 0),
+        }
+    }
 }
\ No newline at end of file
@@ -8,26 +8,93 @@
 
 use std::env;
 use std::error::Error;
+use std::path::Path;
+use std::time::{Duration, Instant};
 use roxmltree::Document;
-use loader_api::Loader;
+use loader_api::{Loader, PpcTransport, SMALL_PAGE, LARGE_PAGE, HUGE_PAGE, MEMORY_PREFAULT, MEMORY_LOCK,
+                 EVENT_LOOP_IO_URING, EVENT_LOOP_IO_URING_SQPOLL};
+use loader_api::topology::{online_cpus, parse_cpu_list, place_domains, read_topology};
 
 const KIBIBYTE: u32 = 1024;
 const MEBIBYTE: u32 = KIBIBYTE * KIBIBYTE;
 const PAGE_SIZE: u32 = 4 * KIBIBYTE;
+const MAX_PRIORITY: u8 = 254;
+const DEFAULT_BUDGET_US: u64 = 1000;
+const DEFAULT_STATS_INTERVAL_S: u64 = 10;
+
+/* --- Read the prefault and mlock attributes of a node, falling back to the given policy for those it does not set --- */
+fn memory_policy(node: &roxmltree::Node, default: i32) -> Result<i32, Box<dyn Error>> {
+    let mut policy = default;
+    for (attribute, flag) in [("prefault", MEMORY_PREFAULT), ("mlock", MEMORY_LOCK)] {
+        match node.attribute(attribute) {
+            None => {}
+            Some("true") => policy |= flag,
+            Some("false") => policy &= !flag,
+            Some(other) => return Err(format!("Expected true or false for '{}', got {:?}", attribute, other).into()),
+        }
+    }
+    // Locked memory is always faulted in first
+    if policy & MEMORY_LOCK != 0 { policy |= MEMORY_PREFAULT; }
+    Ok(policy)
+}
+
+/* --- Turn the perms of a map, any combination of r, w and x, into mmap protections --- */
+fn map_protections(perms: &str) -> Result<i32, Box<dyn Error>> {
+    let mut prot = libc::PROT_NONE;
+    for perm in perms.chars() {
+        prot |= match perm {
+            'r' => libc::PROT_READ,
+            'w' => libc::PROT_WRITE,
+            'x' => libc::PROT_EXEC,
+            _ => return Err(format!("Unknown permission '{}' in perms {:?}", perm, perms).into()),
+        };
+    }
+    if prot == libc::PROT_NONE {
+        return Err("perms on map must not be empty".into());
+    }
+    Ok(prot)
+}
 
 /* --- Find all memory regions and call the C function `create_shared_memory` for each region --- */
 fn process_memory_regions(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn Error>> {
+    let system_policy = memory_policy(&doc.root_element(), 0)?;
     for node in doc.descendants().filter(|n| n.has_tag_name("memory_region")) {
         let region_name = node.attribute("name").expect("Missing attribute 'name' on memory_region");
         let size_str = node.attribute("size").expect("Missing attribute 'size' on memory_region");
         let region_size = u64::from_str_radix(size_str.trim_start_matches("0x"), 16)?;
-        loader.create_shared_memory(region_name, region_size);
+        let page_size = match node.attribute("page_size") {
+            Some(page_str) => u64::from_str_radix(page_str.trim_start_matches("0x"), 16)?,
+            None => SMALL_PAGE,
+        };
+        if ![SMALL_PAGE, LARGE_PAGE, HUGE_PAGE].contains(&page_size) {
+            return Err(format!("Memory region '{}' has page_size {:#x}, expected 0x1000, 0x200000 or 0x40000000",
+                               region_name, page_size).into());
+        }
+        if region_size == 0 || region_size % page_size != 0 {
+            return Err(format!("Memory region '{}' has size {:#x}, which is not a multiple of its page_size {:#x}",
+                               region_name, region_size, page_size).into());
+        }
+        loader.create_shared_memory_with_page_size(region_name, region_size, page_size);
+
+        let policy = memory_policy(&node, system_policy)?;
+        if policy != 0 { loader.set_shared_memory_policy(region_name, policy); }
     }
     Ok(())
 }
 
+/* --- Parse a CPU list attribute and make sure every CPU in it is online --- */
+fn checked_cpu_list(list: &str) -> Result<Vec<u32>, Box<dyn Error>> {
+    let cpus = parse_cpu_list(list)?;
+    let online = online_cpus()?;
+    if let Some(cpu) = cpus.iter().find(|cpu| !online.contains(cpu)) {
+        return Err(format!("CPU {} in CPU list {:?} is not online", cpu, list).into());
+    }
+    Ok(cpus)
+}
+
 /* --- Find all protection domains and call the necessary C functions to create them --- */
 fn process_protection_domains(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn Error>> {
+    let system_policy = memory_policy(&doc.root_element(), 0)?;
     for pd in doc.descendants().filter(|n| n.has_tag_name("protection_domain")) {
         let pd_name_str = pd.attribute("name").expect("Missing attribute 'name' on protection_domain");
         let stack_size_str = pd.attribute("stack_size").unwrap_or("0x1000");
@@ -40,6 +107,61 @@ fn process_protection_domains(doc: &Document, loader: &mut Loader) -> Result<(),
         // We add an extra page size to every protection domain because glibc likes to use a lot of memory!
         loader.create_process(pd_name_str, stack_size + PAGE_SIZE);
 
+        if let Some(priority_str) = pd.attribute("priority") {
+            let priority: u8 = priority_str.parse()?;
+            if priority > MAX_PRIORITY {
+                return Err(format!("Priority must be between 0 and {}", MAX_PRIORITY).into());
+            }
+            loader.set_priority(pd_name_str, priority);
+        }
+
+        // As in seL4 Microkit, the budget defaults to 1000 us and the period to the budget
+        if pd.attribute("budget").is_some() || pd.attribute("period").is_some() {
+            let budget: u64 = pd.attribute("budget").map_or(Ok(DEFAULT_BUDGET_US), str::parse)?;
+            let period: u64 = pd.attribute("period").map_or(Ok(budget), str::parse)?;
+            if budget == 0 || budget > period {
+                return Err("Budget must be non-zero and no larger than the period".into());
+            }
+            loader.set_budget(pd_name_str, budget, period);
+        }
+
+        let cpus_str = match (pd.attribute("cpu"), pd.attribute("cpus")) {
+            (Some(_), Some(_)) => return Err("Only one of 'cpu' and 'cpus' may be given on protection_domain".into()),
+            (cpu, cpus) => cpu.or(cpus),
+        };
+        if let Some(cpus_str) = cpus_str {
+            loader.set_affinity(pd_name_str, checked_cpu_list(cpus_str)?);
+        }
+
+        let policy = memory_policy(&pd, system_policy)?;
+        if policy != 0 { loader.set_memory_policy(pd_name_str, policy); }
+
+        if let Some(drain_budget_str) = pd.attribute("drain_budget") {
+            let drain_budget: u32 = drain_budget_str.parse()?;
+            if drain_budget == 0 {
+                return Err("Drain budget must be at least 1".into());
+            }
+            loader.set_drain_budget(pd_name_str, drain_budget);
+        }
+
+        if let Some(poll_us_str) = pd.attribute("poll_us") {
+            let poll_us: u32 = poll_us_str.parse()?;
+            if poll_us > 0 { loader.set_poll(pd_name_str, poll_us); }
+        }
+
+        match pd.attribute("event_loop").unwrap_or("epoll") {
+            "epoll" => {}
+            "io_uring" => loader.set_event_loop(pd_name_str, EVENT_LOOP_IO_URING),
+            "io_uring_sqpoll" => loader.set_event_loop(pd_name_str, EVENT_LOOP_IO_URING_SQPOLL),
+            other => return Err(format!("Unknown event_loop '{}', expected epoll, io_uring or io_uring_sqpoll", other).into()),
+        }
+
+        match pd.attribute("deferred_notify") {
+            None | Some("false") => {}
+            Some("true") => loader.set_deferred_notify(pd_name_str),
+            Some(other) => return Err(format!("Expected true or false for 'deferred_notify', got {:?}", other).into()),
+        }
+
         if let Some(pd_image) = pd.descendants().find(|n| n.has_tag_name("program_image")) {
             let pd_image_path_raw = pd_image.attribute("path").expect("Missing attribute 'path' on program_image");
             let mut pd_image_path = String::from("./build/");
@@ -48,15 +170,31 @@ fn process_protection_domains(doc: &Document, loader: &mut Loader) -> Result<(),
             loader.set_process_image(pd_name_str, pd_image_path);
         }
 
-        if let Some(pd_map) = pd.descendants().find(|n| n.has_tag_name("map")) {
+        for pd_map in pd.children().filter(|n| n.has_tag_name("map")) {
             let pd_map_name_str = pd_map.attribute("mr").expect("Missing attribute 'mr' on map");
-            let pd_map_varname_str = pd_map.attribute("setvar_vaddr").expect("Missing attribute 'setvar_vaddr' on map");
-            loader.add_shared_memory(pd_name_str, pd_map_name_str, pd_map_varname_str);
+            let vaddr = match pd_map.attribute("vaddr") {
+                Some(vaddr_str) => u64::from_str_radix(vaddr_str.trim_start_matches("0x"), 16)?,
+                None => 0,
+            };
+            let prot = map_protections(pd_map.attribute("perms").unwrap_or("rw"))?;
+            loader.map_shared_memory(pd_name_str, pd_map_name_str, vaddr, prot, pd_map.attribute("setvar_vaddr"));
         }
     }
     Ok(())
 }
 
+/* --- Warn when a protected call can go from a higher to a lower priority domain, which invites priority inversion --- */
+fn check_ppc_priority(loader: &Loader, caller: &str, callee: &str) {
+    // A domain without a priority runs under the default Linux policy, below every real-time one
+    let caller_priority = loader.processes.get(caller).and_then(|p| p.priority);
+    let callee_priority = loader.processes.get(callee).and_then(|p| p.priority);
+    if caller_priority > callee_priority {
+        let describe = |priority: Option<u8>| priority.map_or("default".to_string(), |p| p.to_string());
+        eprintln!("Warning: {} (priority {}) can make protected calls to lower priority {} (priority {})",
+                  caller, describe(caller_priority), callee, describe(callee_priority));
+    }
+}
+
 /* --- Find all communication channels between the processes and create them --- */
 fn process_channels(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn Error>> {
     for channel in doc.descendants().filter(|n| n.has_tag_name("channel")) {
@@ -68,8 +206,27 @@ fn process_channels(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn E
             let id1 = end1.attribute("id").expect("Missing attribute 'id' on first channel end").parse()?;
             let id2 = end2.attribute("id").expect("Missing attribute 'id' on second channel end").parse()?;
             
-            loader.create_channel(pd1, pd2, id1);
-            loader.create_channel(pd2, pd1, id2);
+            loader.connect_channel(pd1, id1, pd2, id2);
+
+            // Any end may call unless the channel marks the calling ends with pp="true", as seL4 does
+            let pp1 = end1.attribute("pp") == Some("true");
+            let pp2 = end2.attribute("pp") == Some("true");
+            if pp1 || !pp2 { check_ppc_priority(loader, pd1, pd2); }
+            if pp2 || !pp1 { check_ppc_priority(loader, pd2, pd1); }
+
+            let transport = match channel.attribute("ppc").unwrap_or("pipe") {
+                "pipe" => PpcTransport::Pipe,
+                "futex" => PpcTransport::Futex,
+                other => return Err(format!("Unknown ppc transport '{}' on channel", other).into()),
+            };
+            loader.set_ppc_transport(pd1, id1, transport);
+            loader.set_ppc_transport(pd2, id2, transport);
+
+            match channel.attribute("ipc_buffer").unwrap_or("copy") {
+                "copy" => {}
+                "shared" => loader.set_channel_ipc_buffer(pd1, id1),
+                other => return Err(format!("Unknown ipc_buffer '{}' on channel", other).into()),
+            }
         } else {
             return Err("Expected exactly two ends for each channel".into());
         }
@@ -77,6 +234,148 @@ fn process_channels(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn E
     Ok(())
 }
 
+/* --- Find the notification groups a domain notifies together, and the ids each member knows them by --- */
+fn process_notification_groups(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn Error>> {
+    for group in doc.descendants().filter(|n| n.has_tag_name("notification_group")) {
+        let sender = group.attribute("pd").expect("Missing attribute 'pd' on notification group");
+        let id = group.attribute("id").expect("Missing attribute 'id' on notification group").parse()?;
+
+        let mut members = 0;
+        for member in group.children().filter(|n| n.has_tag_name("member")) {
+            let pd = member.attribute("pd").expect("Missing attribute 'pd' on notification group member");
+            let member_id = member.attribute("id").expect("Missing attribute 'id' on notification group member").parse()?;
+            loader.add_group_member(sender, id, pd, member_id);
+            members += 1;
+        }
+        if members == 0 {
+            return Err(format!("Notification group {} of {} has no members", id, sender).into());
+        }
+    }
+    Ok(())
+}
+
+/* --- Pin every domain without an explicit cpu/cpus so that connected domains share caches --- */
+fn place_automatically(doc: &Document, loader: &mut Loader) -> Result<(), Box<dyn Error>> {
+    let mut domains: Vec<String> = loader.processes.iter()
+        .filter(|(_, p)| p.cpus.is_empty())
+        .map(|(name, _)| name.clone())
+        .collect();
+    domains.sort();
+
+    let links: Vec<(String, String)> = doc.descendants()
+        .filter(|n| n.has_tag_name("channel"))
+        .filter_map(|channel| {
+            let mut ends = channel.children().filter(|n| n.has_tag_name("end")).filter_map(|end| end.attribute("pd"));
+            Some((ends.next()?.to_string(), ends.next()?.to_string()))
+        })
+        .collect();
+
+    // Leave the CPUs of manually pinned domains to them, unless that leaves nothing
+    let pinned: Vec<u32> = loader.processes.values().flat_map(|p| p.cpus.iter().copied()).collect();
+    let topology = read_topology()?;
+    let mut cpus: Vec<_> = topology.iter().filter(|cpu| !pinned.contains(&cpu.id)).cloned().collect();
+    if cpus.is_empty() {
+        cpus = topology.clone();
+    }
+
+    println!("Automatic placement of {} protection domains on {} CPUs:", domains.len(), cpus.len());
+    for (domain, cpu_id) in place_domains(&domains, &links, &cpus) {
+        let cpu = cpus.iter().find(|cpu| cpu.id == cpu_id).unwrap();
+        println!("  {:<20} -> CPU {} (core {}, L2 group {}, L3 group {})", domain, cpu.id, cpu.core, cpu.l2, cpu.l3);
+        loader.set_affinity(&domain, vec![cpu_id]);
+    }
+    Ok(())
+}
+
+/* --- Find the options that apply to the whole system rather than a single element, returning where and how often to report latencies --- */
+fn process_system_options<'a>(doc: &'a Document, loader: &mut Loader) -> Result<(Option<&'a str>, Duration), Box<dyn Error>> {
+    let system = doc.root_element();
+
+    match system.attribute("placement").unwrap_or("manual") {
+        "manual" => {}
+        "auto" => place_automatically(doc, loader)?,
+        other => return Err(format!("Unknown placement '{}' on system", other).into()),
+    }
+
+    match system.attribute("preload_images") {
+        None | Some("false") => {}
+        Some("true") => loader.set_preload_images(),
+        Some(other) => return Err(format!("Expected true or false for 'preload_images', got {:?}", other).into()),
+    }
+
+    if let Some(trace_path) = system.attribute("trace") {
+        loader.enable_tracing(trace_path);
+    }
+
+    // Writing the histograms to a file implies recording them
+    let latency_stats = match system.attribute("latency_stats") {
+        None => system.attribute("latency_stats_file").is_some(),
+        Some("true") => true,
+        Some("false") => false,
+        Some(other) => return Err(format!("Expected true or false for 'latency_stats', got {:?}", other).into()),
+    };
+    if latency_stats { loader.enable_latency_stats(); }
+
+    let stats_file = system.attribute("latency_stats_file");
+    let stats_interval: u64 = match system.attribute("latency_stats_interval") {
+        None => DEFAULT_STATS_INTERVAL_S,
+        Some(interval_str) => interval_str.parse()
+            .map_err(|_| format!("Expected a number of seconds for 'latency_stats_interval', got {:?}", interval_str))?,
+    };
+    if stats_interval == 0 {
+        return Err("latency_stats_interval must be at least 1 second".into());
+    }
+
+    // Keep the loader, e.g. its budget monitor, off the cores given to protection domains
+    if let Some(loader_cpus_str) = system.attribute("loader_cpus") {
+        let cpus = if loader_cpus_str == "auto" {
+            let pinned: Vec<u32> = loader.processes.values().flat_map(|p| p.cpus.iter().copied()).collect();
+            online_cpus()?.into_iter().filter(|cpu| !pinned.contains(cpu)).collect()
+        } else {
+            checked_cpu_list(loader_cpus_str)?
+        };
+
+        if cpus.is_empty() {
+            eprintln!("Warning: every online CPU is given to a protection domain, leaving the loader unpinned");
+        } else {
+            loader.set_loader_cpus(cpus);
+        }
+    }
+    Ok((stats_file, Duration::from_secs(stats_interval)))
+}
+
+/* --- Block until the loader is asked to stop with SIGINT or SIGTERM, reporting latencies on SIGUSR1 and every interval --- */
+fn wait_for_shutdown(loader: &Loader, stats_file: Option<&str>, stats_interval: Duration) {
+    unsafe {
+        // Only the loader blocks these, the protection domains have already been cloned
+        let mut signals: libc::sigset_t = std::mem::zeroed();
+        libc::sigemptyset(&mut signals);
+        libc::sigaddset(&mut signals, libc::SIGINT);
+        libc::sigaddset(&mut signals, libc::SIGTERM);
+        libc::sigaddset(&mut signals, libc::SIGUSR1);
+        libc::pthread_sigmask(libc::SIG_BLOCK, &signals, std::ptr::null_mut());
+
+        let timeout = libc::timespec {
+            tv_sec: stats_interval.as_secs() as libc::time_t,
+            tv_nsec: stats_interval.subsec_nanos() as libc::c_long,
+        };
+        loop {
+            let signal = match stats_file {
+                Some(_) => libc::sigtimedwait(&signals, std::ptr::null_mut(), &timeout),
+                None => libc::sigwaitinfo(&signals, std::ptr::null_mut()),
+            };
+            match signal {
+                libc::SIGUSR1 => loader.print_latency_stats(None),
+                libc::SIGINT | libc::SIGTERM => break,
+                _ => {} // The interval passed, or the wait was interrupted
+            }
+            if stats_file.is_some() {
+                loader.print_latency_stats(stats_file);
+            }
+        }
+    }
+}
+
 fn main() -> Result<(), Box<dyn Error>> {
     let args: Vec<String> = env::args().collect();
     if args.len() != 2 {
@@ -86,18 +385,32 @@ fn main() -> Result<(), Box<dyn Error>> {
 
     /* -- Grab the C binary we will be dynamically linking into as well as the .system XML file we are parsing --- */
     let mut loader: Loader<> = Loader::new();
-    let xml_content: String = std::fs::read_to_string(format!("./example/{}", &args[1]))?;
+    let system_path = if Path::new(&args[1]).is_file() { args[1].clone() } else { format!("./example/{}", &args[1]) };
+    let parse_start = Instant::now();
+    let xml_content: String = std::fs::read_to_string(system_path)?;
     let doc: Document<'_> = roxmltree::Document::parse(&xml_content)?;
+    let parse_time = parse_start.elapsed();
 
     // Process all components
+    let regions_start = Instant::now();
     process_memory_regions(&doc, &mut loader)?;
+    let regions_time = regions_start.elapsed();
     process_protection_domains(&doc, &mut loader)?;
     process_channels(&doc, &mut loader)?;
+    process_notification_groups(&doc, &mut loader)?;
+    let (stats_file, stats_interval) = process_system_options(&doc, &mut loader)?;
     
     // Run all processes
     loader.run_all_processes();
-    
+
+    // Once asked to stop, tear the protection domains down and report how their event loops fared
+    wait_for_shutdown(&loader, stats_file, stats_interval);
+    loader.stop_all_processes();
+    loader.print_stats();
+    loader.print_startup_timings(parse_time, regions_time);
+    loader.print_latency_stats(None);
+    if stats_file.is_some() { loader.print_latency_stats(stats_file); }
+
     // The loader and its hashmaps are automatically cleaned up here when they go out of scope
-    std::thread::park();
     Ok(())
 }
\ No newline at end of file
@@ -1,16 +1,91 @@
 #include <microkit.h>
 #include <handler.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 extern process_t *proc;
 
+/**
+ * Copies bytes into the console ring, wrapping around its end.
+ * @param ring The console ring of the current process
+ * @param index Where the bytes go in the ring
+ * @param bytes The bytes
+ * @param len The number of bytes
+ */
+static void console_copy(console_ring_t *ring, uint64_t index, const void *bytes, size_t len) {
+    size_t start = index & (CONSOLE_RING_BYTES - 1);
+    size_t first = len < CONSOLE_RING_BYTES - start ? len : CONSOLE_RING_BYTES - start;
+    memcpy(ring->data + start, bytes, first);
+    memcpy(ring->data, (const char *) bytes + first, len - first);
+}
+
+/**
+ * Writes output to the debug console. Every line in the ring starts with the time it was begun,
+ * and output the loader has not made room for is dropped whole, so writing never blocks and never
+ * makes a system call.
+ * @param s The output
+ * @param len Its length in bytes
+ */
+static void console_write(const char *s, size_t len) {
+    console_ring_t *ring = proc != NULL ? proc->console : NULL;
+    if (ring == NULL) {
+        fwrite(s, 1, len, stdout);
+        return;
+    }
+
+    // A timestamp before the first byte, and after every newline that is not the last byte
+    size_t starts = !ring->line_open;
+    for (size_t i = 0; i + 1 < len; ++i) {
+        starts += s[i] == '\n';
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t used = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (len == 0 || used + len + starts * sizeof(uint64_t) > CONSOLE_RING_BYTES) {
+        ring->dropped += len;
+        return;
+    }
+
+    uint64_t now = monotonic_ns();
+    while (len > 0) {
+        if (!ring->line_open) {
+            console_copy(ring, head, &now, sizeof(uint64_t));
+            head += sizeof(uint64_t);
+            ring->line_open = 1;
+        }
+        const char *newline = memchr(s, '\n', len);
+        size_t n = newline != NULL ? (size_t) (newline - s) + 1 : len;
+        console_copy(ring, head, s, n);
+        head += n;
+        if (newline != NULL) ring->line_open = 0;
+        s += n;
+        len -= n;
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+/**
+ * Writes the decimal representation of an integer to the debug console.
+ * @param x The integer
+ */
+static void console_write_decimal(uint32_t x) {
+    char digits[10];
+    int start = sizeof(digits);
+    do {
+        digits[--start] = '0' + x % 10;
+        x /= 10;
+    } while (x != 0);
+    console_write(digits + start, sizeof(digits) - start);
+}
+
 /**
  * Output a single character on the debug console.
  * @param c The character to output
  */
 void microkit_dbg_putc(int c) {
-    printf("%c", c);
+    char byte = c;
+    console_write(&byte, 1);
 }
 
 /**
@@ -18,7 +93,7 @@ void microkit_dbg_putc(int c) {
  * @param s The string to output
  */
 void microkit_dbg_puts(const char *s) {
-    printf("%s", s);
+    console_write(s, strlen(s));
 }
 
 /**
@@ -26,7 +101,7 @@ void microkit_dbg_puts(const char *s) {
  * @param x The 8-bit integer to output
  */
 void microkit_dbg_put8(seL4_Uint8 x) {
-    printf("%u", x);
+    console_write_decimal(x);
 }
 
 /**
@@ -34,17 +109,17 @@ void microkit_dbg_put8(seL4_Uint8 x) {
  * @param x The 32-bit integer to output
  */
 void microkit_dbg_put32(seL4_Uint32 x) {
-    printf("%u", x);
+    console_write_decimal(x);
 }
 
 /**
- * Get the receiver process for a channel
+ * Get the channel end with the provided id in the current process
  * @param ch Channel identifier
  */
-static process_t *get_channel_receiver(microkit_channel ch) {
+static channel_t *get_channel(microkit_channel ch) {
     khash_t(channel) *channel_id_to_process = proc->channel_id_to_process;
     khiter_t iter = kh_get(channel, channel_id_to_process, ch);
-    if (kh_key(channel_id_to_process, iter) != ch) {
+    if (iter == kh_end(channel_id_to_process)) {
         fprintf(stderr, "Channel id %lu is not a valid channel\n", ch);
         exit(EXIT_FAILURE);
     }
@@ -52,11 +127,136 @@ static process_t *get_channel_receiver(microkit_channel ch) {
 }
 
 /**
- * Sends a notification to the specified channel
+ * Accounts for a notification being sent on a channel, whether now or deferred.
+ * @param ch The channel the notification is sent on
+ * @param channel Its channel end
+ */
+static void begin_notify(microkit_channel ch, channel_t *channel) {
+    trace(proc, TRACE_NOTIFY, ch);
+    proc->control->stats.notifications_sent++;
+
+    // Keep the time of the first notification of those the receiver will take in one go
+    if (channel->receiver->latency != NULL) {
+        uint64_t unsent = 0;
+        atomic_compare_exchange_strong(&channel->receiver->control->notify_sent[channel->peer_ch], &unsent,
+                                       monotonic_ns());
+    }
+}
+
+/**
+ * Wakes a receiver whose notification word we made non-empty. Its eventfd is only rung while it
+ * waits for its fds: a receiver that is running looks at its word before it waits again.
+ * @param receiver The process being notified
+ */
+static void wake_notified(process_t *receiver) {
+    // Pairs with the store of the wait state in ready_to_wait, after our update of the word
+    if (atomic_load(&receiver->control->wait_state) == PD_WAIT_EPOLL) {
+        uint64_t ring = 1;
+        write(receiver->notification, &ring, sizeof(uint64_t));
+        proc->control->stats.notify_writes++;
+    }
+    wake_receiver(receiver);
+}
+
+/**
+ * Raises bits in a receiver's notification word. Only the update that makes the word non-empty
+ * wakes the receiver.
+ * @param receiver The process being notified
+ * @param bits The bits to raise, by the ids the receiver knows the channels by
+ */
+static void raise_notifications(process_t *receiver, uint64_t bits) {
+    if (atomic_fetch_or(&receiver->control->notifications, bits) == 0) {
+        wake_notified(receiver);
+    }
+}
+
+/**
+ * Sends a notification to the specified channel. The notification is a bit in the receiver's
+ * notification word, so repeated notifications before the receiver wakes collapse into one. Only
+ * the notification that makes the word non-empty rings the receiver's eventfd. In a protection
+ * domain with `deferred_notify` set, the notification is deferred as by `microkit_deferred_notify`.
  * @param ch An unsigned integer to the channel we will be sending a notification to
  */
 void microkit_notify(microkit_channel ch) {
-    write(get_channel_receiver(ch)->notification, &ch, sizeof(microkit_channel));
+    if (proc->defer_notify) {
+        microkit_deferred_notify(ch);
+        return;
+    }
+
+    channel_t *channel = get_channel(ch);
+    begin_notify(ch, channel);
+    raise_notifications(channel->receiver, 1ull << channel->peer_ch);
+}
+
+/**
+ * Sends a notification to the specified channel once the current entry point returns, or before
+ * the next protected call, whichever comes first. Notifications deferred more than once on a
+ * channel are sent once, and those to the same receiver all go out in a single update of its
+ * notification word.
+ * @param ch An unsigned integer to the channel we will be sending a notification to
+ */
+void microkit_deferred_notify(microkit_channel ch) {
+    begin_notify(ch, get_channel(ch));
+    proc->control->stats.notifications_deferred++;
+    proc->deferred_notify |= 1ull << ch;
+}
+
+/**
+ * Notifies every member of a notification group. The members are known at load time, so no
+ * channel is looked up. All of their notification words are updated before any of them is woken,
+ * so that members woken early do not hold up the others, and only members whose word was empty and
+ * who are waiting are woken at all.
+ * @param group The id of a group we notify
+ */
+void microkit_notify_group(microkit_channel group) {
+    notification_group_t *members = group < MICROKIT_MAX_PDS ? proc->groups[group] : NULL;
+    if (members == NULL) {
+        fprintf(stderr, "Notification group %lu is not a valid group of %s\n", group, proc->name);
+        exit(EXIT_FAILURE);
+    }
+    trace(proc, TRACE_NOTIFY_GROUP, group);
+
+    uint64_t now = proc->latency != NULL ? monotonic_ns() : 0;
+    int woken[members->num_members];
+    for (int i = 0; i < members->num_members; ++i) {
+        group_member_t *member = &members->members[i];
+        proc->control->stats.notifications_sent += __builtin_popcountll(member->bits);
+        if (member->receiver->latency != NULL) {
+            for (uint64_t bits = member->bits; bits != 0; bits &= bits - 1) {
+                uint64_t unsent = 0;
+                atomic_compare_exchange_strong(&member->receiver->control->notify_sent[__builtin_ctzll(bits)],
+                                               &unsent, now);
+            }
+        }
+        woken[i] = atomic_fetch_or(&member->receiver->control->notifications, member->bits) == 0;
+    }
+
+    for (int i = 0; i < members->num_members; ++i) {
+        if (woken[i]) wake_notified(members->members[i].receiver);
+    }
+}
+
+/**
+ * Sends the notifications deferred by `microkit_deferred_notify`, gathering those on channels to
+ * the same receiver into one update of its notification word.
+ */
+void flush_deferred_notifications(void) {
+    uint64_t deferred = proc->deferred_notify;
+    proc->deferred_notify = 0;
+
+    while (deferred != 0) {
+        process_t *receiver = get_channel(__builtin_ctzll(deferred))->receiver;
+        uint64_t bits = 0;
+        for (uint64_t rest = deferred; rest != 0; rest &= rest - 1) {
+            microkit_channel ch = __builtin_ctzll(rest);
+            channel_t *channel = get_channel(ch);
+            if (channel->receiver == receiver) {
+                bits |= 1ull << channel->peer_ch;
+                deferred &= ~(1ull << ch);
+            }
+        }
+        raise_notifications(receiver, bits);
+    }
 }
 
 /**
@@ -97,7 +297,7 @@ seL4_Word microkit_msginfo_get_count(microkit_msginfo msginfo) {
  * @param value The value the message register will be set to
  */
 void microkit_mr_set(seL4_Uint8 mr, seL4_Word value) {
-    proc->ipc_buffer[mr] = value;
+    proc->mrs[mr] = value;
 }
 
 /**
@@ -105,32 +305,285 @@ void microkit_mr_set(seL4_Uint8 mr, seL4_Word value) {
  * @param mr The message register (ipc buffer index) to be retrieved
  */
 seL4_Word microkit_mr_get(seL4_Uint8 mr) {
-    return proc->ipc_buffer[mr];
+    return proc->mrs[mr];
+}
+
+/**
+ * Checks that a channel has no asynchronous call outstanding, since the receiver's IPC buffer for
+ * the channel belongs to that call until it is replied to.
+ * @param ch The channel a call is about to be made on
+ */
+static void check_no_async_call(microkit_channel ch) {
+    if (proc->async_calls & (1ull << ch)) {
+        fprintf(stderr, "Channel id %lu already has an asynchronous call outstanding in %s\n", ch, proc->name);
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
- * Sends a protected procedure call across the provided channel.
+ * Hands the message registers of a call to the receiver, through its IPC buffer for the channel.
+ * @param channel The channel end the call is made on
+ * @param count The number of message registers sent
+ */
+static void send_registers(channel_t *channel, seL4_Uint16 count) {
+    if (!channel->shared_ipc_buffer) {
+        memcpy(channel->ipc_buffer, proc->mrs, count * sizeof(seL4_Word));
+    } else if (proc->mrs != channel->ipc_buffer) {
+        // Registers set anywhere else move over once; after that they are set and read in place
+        memcpy(channel->ipc_buffer, proc->mrs, count * sizeof(seL4_Word));
+        proc->mrs = channel->ipc_buffer;
+    }
+}
+
+/**
+ * Takes the message registers of a reply back from the receiver, and accounts for the finished call.
+ * @param channel The channel end the call was made on
+ * @param ch The id of the channel in the current process
+ * @param reply The reply
+ * @param start_ns When the call was made, if its latency is measured
+ */
+static microkit_msginfo receive_registers(channel_t *channel, microkit_channel ch, microkit_msginfo reply,
+                                          uint64_t start_ns) {
+    seL4_Word label = microkit_msginfo_get_label(reply);
+    seL4_Uint16 count = microkit_msginfo_get_count(reply);
+
+    if (!channel->shared_ipc_buffer) {
+        memcpy(proc->mrs, channel->ipc_buffer, count * sizeof(seL4_Word));
+    } else {
+        proc->mrs = channel->ipc_buffer;
+    }
+    if (proc->latency != NULL) {
+        histogram_record(proc->latency->ppc[ch], monotonic_ns() - start_ns);
+    }
+    return microkit_msginfo_new(label, count);
+}
+
+/**
+ * Posts a protected procedure call to the receiver's pipe.
+ * @param receiver The process being called
+ * @param ch The id the receiver knows the channel by
+ * @param msginfo The message information
+ * @param send_back The pipe to write the reply to, or -1 to post it to our control block
+ * @param caller_ch The id we know the channel by
+ */
+static void post_pipe_call(process_t *receiver, microkit_channel ch, microkit_msginfo msginfo, int send_back,
+                           microkit_channel caller_ch) {
+    message_t send = {.ch = ch, .msginfo = msginfo, .send_back = send_back, .caller = proc, .caller_ch = caller_ch};
+    write(receiver->send_pipe[PIPE_WRITE_FD], &send, sizeof(message_t));
+    wake_receiver(receiver);
+}
+
+/**
+ * Posts a protected procedure call to the channel's call slot and wakes the receiver as it needs.
+ * @param channel The channel end the call is made on
+ * @param ch The id the receiver knows the channel by
+ * @param msginfo The message information
+ * @param async Whether the receiver posts the reply to our control block instead of the slot
+ */
+static void post_futex_call(channel_t *channel, microkit_channel ch, microkit_msginfo msginfo, int async) {
+    ppc_slot_t *slot = channel->slot;
+    pd_control_t *control = channel->receiver->control;
+
+    slot->ch = ch;
+    slot->msginfo = msginfo;
+    slot->async = async;
+    atomic_store(&slot->state, PPC_SLOT_CALL);
+    atomic_fetch_add(&control->event_seq, 1);
+
+    switch (atomic_load(&control->wait_state)) {
+    case PD_WAIT_FUTEX:
+        futex_wake(&control->event_seq, 1);
+        break;
+    case PD_WAIT_EPOLL: {
+        uint64_t ring = 1;
+        write(channel->receiver->ppc_doorbell, &ring, sizeof(uint64_t));
+        break;
+    }
+    default:
+        break; // The receiver looks at its slots again before it goes to sleep
+    }
+}
+
+/**
+ * Makes a protected procedure call over the receiver's pipes and blocks until the reply arrives.
+ * @param receiver The process being called
+ * @param ch The id the receiver knows the channel by
+ * @param msginfo The message information
+ */
+static microkit_msginfo ppcall_pipe(process_t *receiver, microkit_channel ch, microkit_msginfo msginfo) {
+    post_pipe_call(receiver, ch, msginfo, proc->receive_pipe[PIPE_WRITE_FD], 0);
+
+    microkit_msginfo receive;
+    read(proc->receive_pipe[PIPE_READ_FD], &receive, sizeof(microkit_msginfo));
+    return receive;
+}
+
+/**
+ * Makes a protected procedure call through the channel's call slot and blocks on the slot's futex
+ * until the receiver has written its reply there.
+ * @param channel The channel end the call is made on
+ * @param ch The id the receiver knows the channel by
+ * @param msginfo The message information
+ */
+static microkit_msginfo ppcall_futex(channel_t *channel, microkit_channel ch, microkit_msginfo msginfo) {
+    ppc_slot_t *slot = channel->slot;
+    post_futex_call(channel, ch, msginfo, 0);
+
+    uint32_t state;
+    while ((state = atomic_load(&slot->state)) != PPC_SLOT_REPLY) {
+        futex_wait(&slot->state, state, NULL);
+    }
+
+    microkit_msginfo reply = slot->msginfo;
+    atomic_store(&slot->state, PPC_SLOT_IDLE);
+    return reply;
+}
+
+/**
+ * Sends a protected procedure call across the provided channel. The message registers go through
+ * the receiver's IPC buffer for this channel, so other callers of the same receiver never see them.
+ * On a channel with a shared IPC buffer they stay in that buffer, which the receiver reads and
+ * replies in, and they keep using it until a call on another channel.
  * @param ch An unsigned integer to the channel we will be sending a ppc to
  * @param msginfo The message information
  */
 microkit_msginfo microkit_ppcall(microkit_channel ch, microkit_msginfo msginfo) {
-    seL4_Word label = microkit_msginfo_get_label(msginfo);
+    channel_t *channel = get_channel(ch);
+    check_no_async_call(ch);
+    if (proc->deferred_notify != 0) flush_deferred_notifications(); // The server may be waiting for them
+    trace(proc, TRACE_PPCALL_BEGIN, ch);
+    uint64_t start_ns = proc->latency != NULL ? monotonic_ns() : 0;
+
+    send_registers(channel, microkit_msginfo_get_count(msginfo));
+
+    microkit_msginfo receive;
+    if (channel->slot != NULL) {
+        receive = ppcall_futex(channel, channel->peer_ch, msginfo);
+    } else {
+        receive = ppcall_pipe(channel->receiver, channel->peer_ch, msginfo);
+    }
+
+    receive = receive_registers(channel, ch, receive, start_ns);
+    trace(proc, TRACE_PPCALL_END, ch);
+    return receive;
+}
+
+/**
+ * Sends a protected procedure call across the provided channel without waiting for the reply, so
+ * that calls to several receivers can be in progress at once. Each channel can have one such call
+ * outstanding. Its reply is taken with `microkit_ppcall_wait` or `microkit_ppcall_poll`, or, if the
+ * protection domain has a `replied` entry point, delivered to it by the event loop.
+ * @param ch An unsigned integer to the channel we will be sending a ppc to
+ * @param msginfo The message information
+ * @return A ticket for the reply
+ */
+microkit_ticket microkit_ppcall_async(microkit_channel ch, microkit_msginfo msginfo) {
+    channel_t *channel = get_channel(ch);
+    check_no_async_call(ch);
+    if (proc->deferred_notify != 0) flush_deferred_notifications(); // The server may be waiting for them
+    trace(proc, TRACE_PPCALL_ASYNC, ch);
+    if (proc->latency != NULL) proc->async_start_ns[ch] = monotonic_ns();
+
     seL4_Uint16 count = microkit_msginfo_get_count(msginfo);
+    send_registers(channel, count);
+    if (proc->mrs == channel->ipc_buffer) {
+        // The receiver owns the buffer until it replies, so keep setting registers in our own
+        memcpy(proc->ipc_buffer, proc->mrs, count * sizeof(seL4_Word));
+        proc->mrs = proc->ipc_buffer;
+    }
 
-    process_t *receiver = get_channel_receiver(ch);
-    message_t send = {0};
-    send = (message_t){.ch = ch, .msginfo = msginfo, .send_back = proc->receive_pipe[PIPE_WRITE_FD]};
+    proc->async_calls |= 1ull << ch;
+    if (channel->slot != NULL) {
+        post_futex_call(channel, channel->peer_ch, msginfo, 1);
+    } else {
+        post_pipe_call(channel->receiver, channel->peer_ch, msginfo, -1, ch);
+    }
+    return ch;
+}
 
-    memcpy(receiver->ipc_buffer, proc->ipc_buffer, count * sizeof(seL4_Word));
-    write(receiver->send_pipe[PIPE_WRITE_FD], &send, sizeof(message_t));
+/**
+ * Takes the reply to the asynchronous call outstanding on a channel, which must have arrived, and
+ * moves its message registers into place as `microkit_ppcall` would have.
+ * @param ch The channel the call was made on
+ */
+microkit_msginfo take_reply(microkit_channel ch) {
+    channel_t *channel = get_channel(ch);
+    pd_control_t *control = proc->control;
 
-    microkit_msginfo receive;
-    read(proc->receive_pipe[PIPE_READ_FD], &receive, sizeof(microkit_msginfo));
+    atomic_fetch_and(&control->replied, ~(1ull << ch));
+    microkit_msginfo reply = control->replies[ch];
+    if (channel->slot != NULL) {
+        atomic_store(&channel->slot->state, PPC_SLOT_IDLE);
+    }
+    proc->async_calls &= ~(1ull << ch);
 
-    label = microkit_msginfo_get_label(receive);
-    count = microkit_msginfo_get_count(receive);
+    reply = receive_registers(channel, ch, reply, proc->async_start_ns[ch]);
+    trace(proc, TRACE_REPLY, ch);
+    return reply;
+}
 
-    memcpy(proc->ipc_buffer, receiver->ipc_buffer, count * sizeof(seL4_Word));
+/**
+ * Makes sure the event loop looks at the replies still pending after one was taken outside it.
+ * Replies posted while another was pending did not ring, and the event loop takes all of them
+ * once it does look, so this is only needed when the caller took a reply itself.
+ */
+static void ring_for_pending_replies(void) {
+    if (atomic_load(&proc->control->replied) != 0 && proc->entry.replied != NULL) {
+        uint64_t ring = 1;
+        write(proc->notification, &ring, sizeof(uint64_t));
+    }
+}
 
-    return microkit_msginfo_new(label, count);
+/**
+ * Looks up the channel of an outstanding asynchronous call.
+ * @param ticket The ticket returned by `microkit_ppcall_async`
+ */
+static microkit_channel ticket_channel(microkit_ticket ticket) {
+    if (ticket >= MICROKIT_MAX_PDS || !(proc->async_calls & (1ull << ticket))) {
+        fprintf(stderr, "Ticket %lu is not an outstanding call in %s\n", ticket, proc->name);
+        exit(EXIT_FAILURE);
+    }
+    return ticket;
+}
+
+/**
+ * Blocks until the reply to an asynchronous call arrives and returns it, with the reply's message
+ * registers in place. Anything else that arrives in the meantime is left for the event loop.
+ * @param ticket The ticket returned by `microkit_ppcall_async`
+ */
+microkit_msginfo microkit_ppcall_wait(microkit_ticket ticket) {
+    microkit_channel ch = ticket_channel(ticket);
+    pd_control_t *control = proc->control;
+    uint64_t bit = 1ull << ch;
+
+    if (!(atomic_load(&control->replied) & bit)) {
+        if (proc->deferred_notify != 0) flush_deferred_notifications();
+
+        // Posting a reply bumps the event sequence and wakes us while we say we wait on it
+        atomic_store(&control->wait_state, PD_WAIT_FUTEX);
+        for (;;) {
+            uint32_t seq = atomic_load(&control->event_seq);
+            if (atomic_load(&control->replied) & bit) break;
+            futex_wait(&control->event_seq, seq, NULL);
+        }
+        atomic_store(&control->wait_state, PD_RUNNING);
+    }
+    microkit_msginfo reply = take_reply(ch);
+    ring_for_pending_replies();
+    return reply;
+}
+
+/**
+ * Takes the reply to an asynchronous call if it has arrived, without blocking.
+ * @param ticket The ticket returned by `microkit_ppcall_async`
+ * @param reply Set to the reply, with its message registers in place, if it has arrived
+ * @return 1 if the reply was taken, 0 if the call is still in progress
+ */
+int microkit_ppcall_poll(microkit_ticket ticket, microkit_msginfo *reply) {
+    microkit_channel ch = ticket_channel(ticket);
+    if (!(atomic_load(&proc->control->replied) & (1ull << ch))) return 0;
+
+    *reply = take_reply(ch);
+    ring_for_pending_replies();
+    return 1;
 }
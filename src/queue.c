@@ -0,0 +1,267 @@
+/**
+ * Lock-free SPSC and MPSC queues inside shared memory regions. Indices only ever grow and are
+ * reduced modulo the capacity when used, so the queue is full when head - tail == capacity. Each
+ * end wakes the other through an event index in the style of virtio: a waiting end publishes the
+ * index it wants to hear about, and the other end notifies only when it moves past that index.
+ */
+
+#define _GNU_SOURCE
+
+#include <microkit_queue.h>
+#include <handler.h>
+#include <sched.h>
+#include <string.h>
+
+/* How long an MPSC producer spins on earlier producers finishing their entries before yielding */
+#define QUEUE_COMMIT_SPINS 1024
+
+enum queue_state {
+    QUEUE_UNINITIALISED, // The region is zero filled when the loader creates it
+    QUEUE_INITIALISING,
+    QUEUE_READY,
+};
+
+struct microkit_queue_shared {
+    _Atomic uint32_t state;
+    uint32_t type;
+    uint32_t entry_size;
+    uint32_t capacity; // A power of two
+
+    // Written by producers
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE_SIZE))); // Entries before this are ready
+    _Atomic uint64_t reserved; // Entries before this are claimed by MPSC producers
+    _Atomic uint64_t space_event; // The producer wants to hear when tail moves past this
+
+    // Written by the consumer
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE))); // Entries before this are consumed
+    _Atomic uint64_t data_event; // The consumer wants to hear when head moves past this
+
+    char entries[] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/**
+ * Whether moving an index from `old` to `new` passes `event`, allowing for wrap around.
+ * @param event The index the other end is waiting on
+ * @param new The index after the move
+ * @param old The index before the move
+ */
+static inline int need_event(uint64_t event, uint64_t new, uint64_t old) {
+    return new - event - 1 < new - old;
+}
+
+/**
+ * Sets up a queue in a memory region, or attaches to the one the other end set up. Whichever end
+ * comes first lays the queue out while the other waits for it.
+ * @param queue The handle to fill in
+ * @param region The start of the queue in the region, aligned to a cache line
+ * @param region_size The bytes available to the queue
+ * @param entry_size The size of each entry in bytes
+ * @param type MICROKIT_QUEUE_SPSC or MICROKIT_QUEUE_MPSC
+ * @param ch The channel this end notifies the other end on
+ * @return 0, or -1 if the queue does not fit or does not match the one already there
+ */
+int microkit_queue_init(microkit_queue_t *queue, void *region, size_t region_size, uint32_t entry_size,
+                        int type, microkit_channel ch) {
+    microkit_queue_shared_t *shared = region;
+    if (entry_size == 0 || region_size < sizeof(microkit_queue_shared_t) + entry_size) return -1;
+
+    uint64_t fits = (region_size - sizeof(microkit_queue_shared_t)) / entry_size;
+    uint32_t capacity = 1u << (63 - __builtin_clzll(fits < UINT32_MAX ? fits : UINT32_MAX));
+
+    uint32_t state = QUEUE_UNINITIALISED;
+    if (atomic_compare_exchange_strong(&shared->state, &state, QUEUE_INITIALISING)) {
+        shared->type = type;
+        shared->entry_size = entry_size;
+        shared->capacity = capacity;
+        atomic_store(&shared->head, 0);
+        atomic_store(&shared->reserved, 0);
+        atomic_store(&shared->space_event, UINT64_MAX); // Already passed, so nobody is waiting
+        atomic_store(&shared->tail, 0);
+        atomic_store(&shared->data_event, 0); // The consumer starts out waiting for the first entry
+        atomic_store(&shared->state, QUEUE_READY);
+    } else {
+        while (atomic_load(&shared->state) != QUEUE_READY) sched_yield();
+    }
+
+    if (shared->type != (uint32_t) type || shared->entry_size != entry_size || shared->capacity != capacity) {
+        return -1;
+    }
+
+    queue->shared = shared;
+    queue->ch = ch;
+    queue->cached = 0;
+    queue->notifications = 0;
+    return 0;
+}
+
+uint32_t microkit_queue_capacity(microkit_queue_t *queue) {
+    return queue->shared->capacity;
+}
+
+/**
+ * Copies entries between a buffer and the ring, wrapping around its end.
+ * @param shared The queue
+ * @param index The index of the first entry in the ring
+ * @param buffer The entries outside the ring
+ * @param count The number of entries
+ * @param into_ring Whether to copy into the ring or out of it
+ */
+static void copy_entries(microkit_queue_shared_t *shared, uint64_t index, void *buffer, uint32_t count,
+                         int into_ring) {
+    uint32_t start = index & (shared->capacity - 1);
+    uint32_t first = count < shared->capacity - start ? count : shared->capacity - start;
+    size_t size = shared->entry_size;
+
+    char *ring = shared->entries + start * size;
+    char *rest = (char *) buffer + first * size;
+    if (into_ring) {
+        memcpy(ring, buffer, first * size);
+        memcpy(shared->entries, rest, (count - first) * size);
+    } else {
+        memcpy(buffer, ring, first * size);
+        memcpy(rest, shared->entries, (count - first) * size);
+    }
+}
+
+/**
+ * Publishes entries up to `new` and notifies the consumer if it is waiting for one of them.
+ * @param queue The producer's handle
+ * @param old The head before the entries
+ * @param new The head after them
+ */
+static void publish(microkit_queue_t *queue, uint64_t old, uint64_t new) {
+    microkit_queue_shared_t *shared = queue->shared;
+    atomic_store_explicit(&shared->head, new, memory_order_release);
+
+    // Pairs with the fence in microkit_queue_dequeue, so either we see its event or it sees our head
+    atomic_thread_fence(memory_order_seq_cst);
+    if (need_event(atomic_load_explicit(&shared->data_event, memory_order_relaxed), new, old)) {
+        microkit_notify(queue->ch);
+        queue->notifications++;
+    }
+}
+
+/**
+ * Enqueues into a single producer queue. Once it is full, asks the consumer for a notification
+ * and looks once more, so that space freed in the meantime is not missed.
+ * @param queue The producer's handle
+ * @param entries The entries
+ * @param count The number of entries
+ */
+static uint32_t enqueue_spsc(microkit_queue_t *queue, const char *entries, uint32_t count) {
+    microkit_queue_shared_t *shared = queue->shared;
+    uint64_t head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+    uint32_t total = 0;
+
+    for (;;) {
+        if (head - queue->cached + (count - total) > shared->capacity) {
+            queue->cached = atomic_load_explicit(&shared->tail, memory_order_acquire);
+        }
+        uint32_t space = shared->capacity - (head - queue->cached);
+        uint32_t n = count - total < space ? count - total : space;
+        if (n > 0) {
+            copy_entries(shared, head, (char *) entries + (size_t) total * shared->entry_size, n, 1);
+            publish(queue, head, head + n);
+            head += n;
+            total += n;
+        }
+        if (total == count) return total;
+
+        // Full: ask to hear when the entry at `head` frees up, then check it has not already
+        atomic_store_explicit(&shared->space_event, head - shared->capacity, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        queue->cached = atomic_load_explicit(&shared->tail, memory_order_acquire);
+        if (head - queue->cached == shared->capacity) return total;
+    }
+}
+
+/**
+ * Enqueues into a multi-producer queue. Producers claim their entries with a compare and swap on
+ * `reserved`, fill them in, and publish them in the order they were claimed.
+ * @param queue The producer's handle
+ * @param entries The entries
+ * @param count The number of entries
+ */
+static uint32_t enqueue_mpsc(microkit_queue_t *queue, const char *entries, uint32_t count) {
+    microkit_queue_shared_t *shared = queue->shared;
+    uint64_t start = atomic_load_explicit(&shared->reserved, memory_order_relaxed);
+    uint32_t n;
+
+    do {
+        if (start - queue->cached + count > shared->capacity) {
+            queue->cached = atomic_load_explicit(&shared->tail, memory_order_acquire);
+        }
+        uint32_t space = shared->capacity - (start - queue->cached);
+        n = count < space ? count : space;
+        if (n == 0) return 0;
+    } while (!atomic_compare_exchange_weak(&shared->reserved, &start, start + n));
+
+    copy_entries(shared, start, (void *) entries, n, 1);
+
+    // Entries claimed before ours have to be published first
+    for (unsigned int spins = 1; atomic_load_explicit(&shared->head, memory_order_acquire) != start; ++spins) {
+        if (spins % QUEUE_COMMIT_SPINS == 0) sched_yield();
+    }
+    publish(queue, start, start + n);
+    return n;
+}
+
+/**
+ * Copies entries into the queue.
+ * @param queue A producer's handle
+ * @param entries The entries
+ * @param count The number of entries
+ * @return How many entries fit. Fewer than `count` on an SPSC queue means the producer will be
+ *         notified once there is space.
+ */
+uint32_t microkit_queue_enqueue(microkit_queue_t *queue, const void *entries, uint32_t count) {
+    if (queue->shared->type == MICROKIT_QUEUE_MPSC) {
+        return enqueue_mpsc(queue, entries, count);
+    }
+    return enqueue_spsc(queue, entries, count);
+}
+
+/**
+ * Copies entries out of the queue. Once it is empty, asks the producers for a notification and
+ * looks once more, so that entries enqueued in the meantime are not missed.
+ * @param queue The consumer's handle
+ * @param entries Where to copy the entries
+ * @param max The most entries to copy
+ * @return How many entries were copied. Fewer than `max` means the consumer will be notified once
+ *         there are more.
+ */
+uint32_t microkit_queue_dequeue(microkit_queue_t *queue, void *entries, uint32_t max) {
+    microkit_queue_shared_t *shared = queue->shared;
+    uint64_t tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+    uint32_t total = 0;
+
+    for (;;) {
+        if (queue->cached - tail < max - total) {
+            queue->cached = atomic_load_explicit(&shared->head, memory_order_acquire);
+        }
+        uint32_t available = queue->cached - tail;
+        uint32_t n = max - total < available ? max - total : available;
+        if (n > 0) {
+            copy_entries(shared, tail, (char *) entries + (size_t) total * shared->entry_size, n, 0);
+            atomic_store_explicit(&shared->tail, tail + n, memory_order_release);
+
+            // Only the producer of an SPSC queue waits for space
+            if (shared->type == MICROKIT_QUEUE_SPSC) {
+                atomic_thread_fence(memory_order_seq_cst);
+                if (need_event(atomic_load_explicit(&shared->space_event, memory_order_relaxed), tail + n, tail)) {
+                    microkit_notify(queue->ch);
+                    queue->notifications++;
+                }
+            }
+            tail += n;
+            total += n;
+        }
+        if (total == max) return total;
+
+        // Empty: ask to hear when the entry at `tail` is published, then check it has not been already
+        atomic_store_explicit(&shared->data_event, tail, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        queue->cached = atomic_load_explicit(&shared->head, memory_order_acquire);
+        if (queue->cached == tail) return total;
+    }
+}
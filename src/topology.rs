@@ -0,0 +1,143 @@
+/**
+ * Helpers for working out which CPUs exist on this machine and for reading the CPU lists
+ * used both by the kernel in /sys and by the cpus attributes of a .system file.
+ * 
+ * Author: Michael Mospan (@mmospan)
+ */
+
+use std::collections::HashMap;
+use std::fs;
+
+const ONLINE_CPUS_PATH: &str = "/sys/devices/system/cpu/online";
+
+/// Parses a CPU list such as "0-3,6" into the sorted, deduplicated CPU numbers it names.
+pub fn parse_cpu_list(list: &str) -> Result<Vec<u32>, String> {
+    let mut cpus = Vec::new();
+    for part in list.trim().split(',').filter(|p| !p.trim().is_empty()) {
+        let parse = |s: &str| s.trim().parse::<u32>().map_err(|_| format!("Invalid CPU number {:?} in CPU list {:?}", s, list));
+        match part.split_once('-') {
+            Some((first, last)) => {
+                let (first, last) = (parse(first)?, parse(last)?);
+                if first > last {
+                    return Err(format!("Invalid CPU range {:?} in CPU list {:?}", part, list));
+                }
+                cpus.extend(first..=last);
+            }
+            None => cpus.push(parse(part)?),
+        }
+    }
+    if cpus.is_empty() {
+        return Err(format!("CPU list {:?} is empty", list));
+    }
+    cpus.sort_unstable();
+    cpus.dedup();
+    Ok(cpus)
+}
+
+/// Returns the CPUs the kernel currently has online.
+pub fn online_cpus() -> Result<Vec<u32>, String> {
+    let list = fs::read_to_string(ONLINE_CPUS_PATH).map_err(|e| format!("Could not read {}: {}", ONLINE_CPUS_PATH, e))?;
+    parse_cpu_list(&list)
+}
+
+/// Where a CPU sits in the cache hierarchy. Each group is named by the lowest CPU in it, so two
+/// CPUs with the same `l2` share an L2 cache and two with the same `core` are SMT siblings.
+#[derive(Clone, Debug, PartialEq)]
+pub struct Cpu {
+    pub id: u32,
+    pub core: u32,
+    pub l2: u32,
+    pub l3: u32,
+}
+
+/* --- Read the first CPU of a CPU list file in /sys, i.e. the name of the group it describes --- */
+fn first_cpu_in(path: &str) -> Option<u32> {
+    parse_cpu_list(&fs::read_to_string(path).ok()?).ok()?.first().copied()
+}
+
+/// Reads the cache topology of every online CPU from /sys/devices/system/cpu. Caches the kernel
+/// does not describe, as is common in VMs, are assumed not to be shared.
+pub fn read_topology() -> Result<Vec<Cpu>, String> {
+    let mut cpus = Vec::new();
+    for id in online_cpus()? {
+        let base = format!("/sys/devices/system/cpu/cpu{}", id);
+        let core = first_cpu_in(&format!("{}/topology/thread_siblings_list", base)).unwrap_or(id);
+        let mut cpu = Cpu { id, core, l2: core, l3: core };
+
+        for index in fs::read_dir(format!("{}/cache", base)).into_iter().flatten().flatten() {
+            let index_path = index.path().to_string_lossy().into_owned();
+            let level = fs::read_to_string(format!("{}/level", index_path)).unwrap_or_default();
+            let shared = first_cpu_in(&format!("{}/shared_cpu_list", index_path));
+            match (level.trim(), shared) {
+                ("2", Some(group)) => cpu.l2 = group,
+                ("3", Some(group)) => cpu.l3 = group,
+                _ => {}
+            }
+        }
+        // Without an L3 the widest sharing we know of is the L2
+        if cpu.l3 == core && cpu.l2 != core {
+            cpu.l3 = cpu.l2;
+        }
+        cpus.push(cpu);
+    }
+    Ok(cpus)
+}
+
+/// Chooses a CPU for every domain so that heavily connected domains end up on the same or
+/// cache-sharing CPUs. `links` holds one entry per channel, so a pair connected by several
+/// channels weighs more.
+///
+/// Domains are first put in a line in which each one is the unplaced domain most connected to the
+/// one before it. CPUs are sorted so that cache-sharing CPUs are next to each other, and the line of
+/// domains is then laid along the CPUs: one domain per CPU while there are enough of them, and in
+/// contiguous runs of domains per CPU otherwise.
+pub fn place_domains(domains: &[String], links: &[(String, String)], cpus: &[Cpu]) -> Vec<(String, u32)> {
+    if domains.is_empty() || cpus.is_empty() {
+        return Vec::new();
+    }
+
+    // Sorting by name first keeps the layout stable for equally connected domains
+    let mut names: Vec<&String> = domains.iter().collect();
+    names.sort();
+    let index: HashMap<&str, usize> = names.iter().enumerate().map(|(i, name)| (name.as_str(), i)).collect();
+
+    // Channels between each pair of domains, counted once so that placing stays quadratic
+    let mut weight = vec![vec![0usize; names.len()]; names.len()];
+    for (a, b) in links {
+        if let (Some(&a), Some(&b)) = (index.get(a.as_str()), index.get(b.as_str())) {
+            weight[a][b] += 1;
+            if a != b {
+                weight[b][a] += 1;
+            }
+        }
+    }
+    let total_weight: Vec<usize> = weight.iter().map(|row| row.iter().sum()).collect();
+
+    // The weight from each domain to those already in the line, kept up to date as the line grows
+    let mut to_placed = vec![0usize; names.len()];
+    let mut unplaced: Vec<usize> = (0..names.len()).collect();
+    let mut line: Vec<usize> = Vec::new();
+
+    while !unplaced.is_empty() {
+        let next = match line.last() {
+            Some(&last) => (0..unplaced.len()).max_by_key(|&i| {
+                let d = unplaced[i];
+                (weight[d][last], to_placed[d], total_weight[d], std::cmp::Reverse(i))
+            }),
+            None => (0..unplaced.len()).max_by_key(|&i| (total_weight[unplaced[i]], std::cmp::Reverse(i))),
+        };
+        let placed = unplaced.remove(next.unwrap());
+        for &d in &unplaced {
+            to_placed[d] += weight[d][placed];
+        }
+        line.push(placed);
+    }
+
+    let mut ordered: Vec<&Cpu> = cpus.iter().collect();
+    ordered.sort_by_key(|cpu| (cpu.l3, cpu.l2, cpu.core, cpu.id));
+
+    line.iter().enumerate().map(|(i, domain)| {
+        let slot = if line.len() <= ordered.len() { i } else { i * ordered.len() / line.len() };
+        (names[*domain].clone(), ordered[slot].id)
+    }).collect()
+}
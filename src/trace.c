@@ -0,0 +1,175 @@
+/**
+ * The loader's side of tracing. Every traced protection domain writes events into its own ring in
+ * shared memory; a thread in the loader drains the rings into a trace in the Chrome JSON format,
+ * which can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ */
+
+#define _GNU_SOURCE
+
+#include <handler.h>
+#include <sys/mman.h>
+
+#define TRACE_DRAIN_INTERVAL_NS 10000000
+
+static FILE *trace_file = NULL;
+static const char *trace_path = NULL;
+static process_t **traced_processes = NULL;
+static int num_traced_processes = 0;
+static uint64_t trace_start_ns;
+static uint64_t traced_events = 0;
+static pthread_t trace_writer_thread;
+static atomic_int trace_writer_running = 0;
+
+/**
+ * Opens the file the trace is written to. Must be called before any process is traced.
+ * 
+ * @param path Where to write the trace. This is a Rust owned string.
+ */
+void open_trace(const char *path) {
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        fprintf(stderr, "Error on opening trace file %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    trace_path = path;
+
+    trace_start_ns = monotonic_ns();
+
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"microkit\"}}",
+            getpid());
+}
+
+/**
+ * Gives a process a trace ring, so that it records its events from the moment it starts.
+ * 
+ * @param process Handle to the process
+ */
+void trace_process(process_t *process) {
+    if (trace_file == NULL) {
+        fprintf(stderr, "Tracing %s before a trace file was opened\n", process->name);
+        exit(EXIT_FAILURE);
+    }
+
+    process->trace = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (process->trace == MAP_FAILED) {
+        fprintf(stderr, "Error on creating the trace ring of %s\n", process->name);
+        exit(EXIT_FAILURE);
+    }
+
+    process_t **grown = realloc(traced_processes, (num_traced_processes + 1) * sizeof(process_t *));
+    if (grown == NULL) {
+        fprintf(stderr, "Error on allocating the list of traced processes\n");
+        exit(EXIT_FAILURE);
+    }
+    traced_processes = grown;
+    traced_processes[num_traced_processes++] = process;
+}
+
+/**
+ * Writes out the events a process has recorded since the last drain and hands their slots back.
+ * 
+ * @param process A traced process
+ */
+static void drain_trace_ring(process_t *process) {
+    static const char *const names[] = {
+        [TRACE_INIT_BEGIN] = "init",
+        [TRACE_NOTIFIED_BEGIN] = "notified",
+        [TRACE_PROTECTED_BEGIN] = "protected",
+        [TRACE_PPCALL_BEGIN] = "ppcall",
+        [TRACE_NOTIFY] = "notify",
+        [TRACE_WAKEUP] = "wakeup",
+        [TRACE_PPCALL_ASYNC] = "ppcall_async",
+        [TRACE_REPLY] = "reply",
+        [TRACE_REPLIED_BEGIN] = "replied",
+        [TRACE_NOTIFY_GROUP] = "notify_group",
+    };
+
+    trace_ring_t *ring = process->trace;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    traced_events += head - tail;
+
+    for (; tail != head; ++tail) {
+        trace_event_t *event = &ring->events[tail & (TRACE_RING_EVENTS - 1)];
+        double ts = (double) (int64_t) (event->timestamp - trace_start_ns) / 1000.0;
+
+        fprintf(trace_file, ",\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,", getpid(), process->pid, ts);
+        switch (event->type) {
+        case TRACE_INIT_END:
+        case TRACE_NOTIFIED_END:
+        case TRACE_PROTECTED_END:
+        case TRACE_PPCALL_END:
+        case TRACE_REPLIED_END:
+            fprintf(trace_file, "\"ph\":\"E\"}");
+            break;
+        case TRACE_NOTIFY:
+        case TRACE_WAKEUP:
+        case TRACE_PPCALL_ASYNC:
+        case TRACE_REPLY:
+        case TRACE_NOTIFY_GROUP:
+            fprintf(trace_file, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"ch\":%u}}",
+                    names[event->type], event->ch);
+            break;
+        default:
+            fprintf(trace_file, "\"ph\":\"B\",\"name\":\"%s\",\"args\":{\"ch\":%u}}", names[event->type], event->ch);
+        }
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+/**
+ * Drains every trace ring in turn until stopped.
+ */
+static void *trace_writer(void *arg) {
+    const struct timespec interval = {.tv_sec = 0, .tv_nsec = TRACE_DRAIN_INTERVAL_NS};
+
+    while (atomic_load(&trace_writer_running)) {
+        for (int i = 0; i < num_traced_processes; ++i) {
+            drain_trace_ring(traced_processes[i]);
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Names the traced processes in the trace and starts draining their rings. Called once every
+ * process is running, as each is identified by its pid.
+ */
+void start_trace_writer(void) {
+    if (trace_file == NULL || atomic_exchange(&trace_writer_running, 1)) return;
+
+    for (int i = 0; i < num_traced_processes; ++i) {
+        fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                getpid(), traced_processes[i]->pid, traced_processes[i]->name);
+    }
+
+    start_loader_thread(&trace_writer_thread, trace_writer, "trace writer");
+}
+
+/**
+ * Stops the trace writer, drains what is left in the rings and finishes the trace. Called once
+ * the traced processes have stopped.
+ */
+void stop_trace_writer(void) {
+    if (trace_file == NULL) return;
+    if (atomic_exchange(&trace_writer_running, 0)) {
+        pthread_join(trace_writer_thread, NULL);
+    }
+
+    uint64_t dropped = 0;
+    for (int i = 0; i < num_traced_processes; ++i) {
+        drain_trace_ring(traced_processes[i]);
+        dropped += traced_processes[i]->trace->dropped;
+    }
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = NULL;
+
+    printf("Trace of %lu events written to %s", traced_events, trace_path);
+    if (dropped > 0) {
+        printf(" (%lu dropped, the loader fell %d events behind)", dropped, TRACE_RING_EVENTS);
+    }
+    printf("\n");
+}
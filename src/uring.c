@@ -0,0 +1,335 @@
+/**
+ * A minimal io_uring, driven with raw system calls, for the io_uring event loop of a protection
+ * domain. The event loop keeps one multishot read armed on each of its fds, which the kernel fills
+ * into buffers the ring provides, and queues its replies as writes. Waiting for the next events
+ * then submits the replies in the same `io_uring_enter`, and with SQPOLL a kernel thread submits
+ * them without any system call at all.
+ */
+
+#define _GNU_SOURCE
+
+#include <handler.h>
+
+#if MICROKIT_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern process_t *proc;
+
+// Multishot reads came in Linux 6.7, after many uapi headers were written
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_SIZE (PPC_READ_BATCH * sizeof(message_t)) // Whole messages, as for the epoll loop's reads
+#define URING_REPLY_SLOTS (URING_BUFFERS * PPC_READ_BATCH) // Replies being written, as many as one wakeup can read calls
+
+struct uring {
+    int fd;
+    int sqpoll;
+    uint64_t *syscalls; // The owning domain's counter of event loop system calls
+
+    // Submission queue, shared with the kernel
+    _Atomic uint32_t *sq_head;
+    _Atomic uint32_t *sq_tail;
+    _Atomic uint32_t *sq_flags;
+    uint32_t sq_mask;
+    struct io_uring_sqe *sqes;
+    uint32_t sq_queued; // Our tail, ahead of the kernel's until the entries are published
+    uint32_t sq_submitted; // Entries already handed to the kernel
+
+    // Completion queue, shared with the kernel
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Buffers for the multishot reads, handed back to the kernel once their contents are used
+    struct io_uring_buf_ring *buffer_ring;
+    char *buffers;
+    uint16_t buffer_tail;
+
+    // Replies being written, each slot in use until the completion of its write arrives
+    microkit_msginfo replies[URING_REPLY_SLOTS];
+    uint64_t free_replies[URING_REPLY_SLOTS / 64]; // Bit n of word w is set if slot 64 * w + n is free
+};
+
+static inline int io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(SYS_io_uring_setup, entries, params);
+}
+
+static inline int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Maps a part of the ring the kernel shares with us, exiting on failure.
+ * @param fd The ring
+ * @param size The size of the part
+ * @param offset IORING_OFF_* of the part
+ */
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error on mapping io_uring in %s\n", proc->name);
+        exit(EXIT_FAILURE);
+    }
+    return map;
+}
+
+/**
+ * Hands a buffer back to the kernel for the multishot reads to fill.
+ * @param ring The ring
+ * @param id The buffer id
+ */
+static void provide_buffer(uring_t *ring, uint16_t id) {
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFERS - 1)];
+    buffer->addr = (uint64_t) (ring->buffers + (size_t) id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    atomic_store_explicit((_Atomic uint16_t *) &ring->buffer_ring->tail, ++ring->buffer_tail, memory_order_release);
+}
+
+/**
+ * Creates the ring of the current process, with the buffers its multishot reads fill. Exits if the
+ * kernel cannot provide it.
+ * @param process The current process
+ * @param sqpoll Whether a kernel thread polls the submission queue
+ */
+uring_t *uring_create(process_t *process, int sqpoll) {
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    struct io_uring_params params = {0};
+    if (sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = URING_SQPOLL_IDLE_MS;
+    } else {
+        // Only we submit, and completions can wait until we next enter the kernel
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    }
+
+    ring->fd = io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        fprintf(stderr, "Error on creating io_uring in %s: %s\n", process->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ring->sqpoll = sqpoll;
+    ring->syscalls = &process->control->stats.syscalls;
+    memset(ring->free_replies, 0xff, sizeof(ring->free_replies));
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = map_ring(ring->fd, sq_size > cq_size ? sq_size : cq_size, IORING_OFF_SQ_RING);
+    char *cq = sq; // IORING_FEAT_SINGLE_MMAP, which every kernel with multishot reads has
+
+    ring->sq_head = (_Atomic uint32_t *) (sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic uint32_t *) (sq + params.sq_off.tail);
+    ring->sq_flags = (_Atomic uint32_t *) (sq + params.sq_off.flags);
+    ring->sq_mask = *(uint32_t *) (sq + params.sq_off.ring_mask);
+    ring->sqes = map_ring(ring->fd, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+
+    // Submission queue entries are used in order, so the index array never changes
+    uint32_t *array = (uint32_t *) (sq + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; ++i) array[i] = i;
+
+    ring->cq_head = (_Atomic uint32_t *) (cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    ring->buffer_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    ring->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) ring->buffer_ring, .ring_entries = URING_BUFFERS, .bgid = URING_BUFFER_GROUP,
+    };
+    if (ring->buffer_ring == MAP_FAILED || io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "Error on providing io_uring buffers in %s: %s\n", process->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (uint16_t id = 0; id < URING_BUFFERS; ++id) provide_buffer(ring, id);
+    return ring;
+}
+
+/**
+ * Takes the next free submission queue entry, submitting the queued ones first if they fill the queue.
+ * @param ring The ring
+ */
+static struct io_uring_sqe *next_sqe(uring_t *ring) {
+    while (ring->sq_queued - atomic_load_explicit(ring->sq_head, memory_order_acquire) > ring->sq_mask) {
+        uring_submit(ring);
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_queued & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Publishes the entry taken by `next_sqe` to the kernel. It is submitted by the next `uring_enter`,
+ * or by the SQPOLL thread.
+ * @param ring The ring
+ */
+static void queue_sqe(uring_t *ring) {
+    atomic_store_explicit(ring->sq_tail, ++ring->sq_queued, memory_order_release);
+}
+
+/**
+ * Arms a multishot read, which completes with a buffer of data every time the fd has some, until
+ * it runs out of buffers or fails. Its last completion comes without IORING_CQE_F_MORE.
+ * @param ring The ring
+ * @param fd The fd to read
+ * @param event The uring_event its completions carry
+ */
+void uring_read_multishot(uring_t *ring, int fd, uint64_t event) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = event;
+    queue_sqe(ring);
+}
+
+/**
+ * Queues the reply to a protected procedure call for writing into the caller's reply pipe.
+ * @param ring The ring
+ * @param fd The caller's reply pipe
+ * @param reply The reply
+ */
+void uring_write_reply(uring_t *ring, int fd, microkit_msginfo reply) {
+    int index = -1;
+    for (int w = 0; w < URING_REPLY_SLOTS / 64; ++w) {
+        if (ring->free_replies[w] != 0) {
+            index = w * 64 + __builtin_ctzll(ring->free_replies[w]);
+            break;
+        }
+    }
+    // A caller reads its reply pipe as soon as it is written, so slots only run out if one stops doing that
+    if (index == -1) {
+        write(fd, &reply, sizeof(microkit_msginfo));
+        (*ring->syscalls)++;
+        return;
+    }
+
+    microkit_msginfo *slot = &ring->replies[index];
+    *slot = reply;
+    ring->free_replies[index / 64] &= ~(1ull << (index % 64));
+
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) slot;
+    sqe->len = sizeof(microkit_msginfo);
+    sqe->off = -1;
+    sqe->user_data = URING_REPLY_WRITTEN + index;
+    queue_sqe(ring);
+}
+
+/**
+ * How many queued entries need an `io_uring_enter` to be submitted. With SQPOLL that is none,
+ * unless the kernel thread has gone idle and has to be woken up.
+ * @param ring The ring
+ * @param flags Set to the IORING_ENTER_* flags the submission needs
+ */
+static uint32_t to_submit(uring_t *ring, unsigned int *flags) {
+    uint32_t queued = ring->sq_queued - ring->sq_submitted;
+    if (!ring->sqpoll) return queued;
+
+    atomic_thread_fence(memory_order_seq_cst); // Our tail is visible before we look at the flags
+    if (atomic_load_explicit(ring->sq_head, memory_order_relaxed) == ring->sq_queued ||
+        !(atomic_load(ring->sq_flags) & IORING_SQ_NEED_WAKEUP)) {
+        return 0;
+    }
+    *flags |= IORING_ENTER_SQ_WAKEUP;
+    return 1;
+}
+
+/**
+ * Submits the queued entries, if that needs a system call, without looking for completions.
+ * @param ring The ring
+ */
+void uring_submit(uring_t *ring) {
+    unsigned int flags = 0;
+    uint32_t count = to_submit(ring, &flags);
+    if (count == 0) return;
+
+    int ret = io_uring_enter(ring->fd, count, 0, flags);
+    (*ring->syscalls)++;
+    if (ret > 0 && !ring->sqpoll) ring->sq_submitted += ret;
+}
+
+/**
+ * Submits the queued entries and collects the completions that are due. If `wait` and none has
+ * arrived, blocks until one does. Makes no system call when there is nothing to submit and a
+ * completion is already waiting, or, with SQPOLL, when not asked to wait.
+ * @param ring The ring
+ * @param wait Whether to block until there is a completion
+ * @return 0, or -errno, e.g. -EINTR when a signal interrupts the wait
+ */
+int uring_enter(uring_t *ring, int wait) {
+    unsigned int flags = IORING_ENTER_GETEVENTS;
+    uint32_t count = to_submit(ring, &flags);
+    int ready = atomic_load_explicit(ring->cq_head, memory_order_relaxed) !=
+                atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+
+    // Completions of an SQPOLL ring are posted by its kernel thread, without our help
+    if (count == 0 && (ready || (!wait && ring->sqpoll))) return 0;
+
+    int ret = io_uring_enter(ring->fd, count, wait && !ready ? 1 : 0, flags);
+    (*ring->syscalls)++;
+    if (ret < 0) return -errno;
+    if (!ring->sqpoll) ring->sq_submitted += ret;
+    return 0;
+}
+
+/**
+ * Takes the next completion off the ring. The buffer of a read stays ours until `uring_release`.
+ * Completions of reply writes are accounted for here and never returned.
+ * @param ring The ring
+ * @param cqe Where to copy the completion
+ * @return Whether there was a completion
+ */
+int uring_next(uring_t *ring, struct io_uring_cqe *cqe) {
+    for (;;) {
+        uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) return 0;
+
+        *cqe = ring->cqes[head & ring->cq_mask];
+        atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+        if (cqe->user_data < URING_REPLY_WRITTEN) return 1;
+
+        uint64_t index = cqe->user_data - URING_REPLY_WRITTEN;
+        ring->free_replies[index / 64] |= 1ull << (index % 64);
+        if (cqe->res < 0) {
+            fprintf(stderr, "Error on writing a reply in %s: %s\n", proc->name, strerror(-cqe->res));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * The data a multishot read completed with, or NULL if it completed without any.
+ * @param ring The ring
+ * @param cqe The completion
+ */
+void *uring_buffer(uring_t *ring, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) return NULL;
+    return ring->buffers + (size_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+}
+
+/**
+ * Hands the buffer of a completed read back to the kernel.
+ * @param ring The ring
+ * @param cqe The completion
+ */
+void uring_release(uring_t *ring, const struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) provide_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+#endif
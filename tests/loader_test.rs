@@ -1,5 +1,12 @@
 use loader_api::*;
-use std::os::raw::{c_int, c_void};
+use loader_api::topology::{parse_cpu_list, place_domains, Cpu};
+use std::os::raw::{c_char, c_int, c_void};
+
+unsafe extern "C" {
+    fn microkit_dbg_puts(s: *const c_char);
+    #[link_name = "proc"]
+    static mut proc_global: ProcessHandle;
+}
 
 /* --- HELPER FUNCTIONS --- */
 
@@ -97,6 +104,26 @@ fn test_shared_memory_creation() {
     }
 }
 
+#[test]
+fn test_large_page_shared_memory() {
+    let mut loader = Loader::new();
+    loader.create_shared_memory_with_page_size("test_large", 2 * LARGE_PAGE, LARGE_PAGE);
+    let shm = loader.get_shared_memory_handle("test_large").unwrap();
+    let shm_struct = unsafe { &*(shm as *const SharedMemory) };
+
+    assert_eq!(shm_struct.size, 2 * LARGE_PAGE, "Expected shared memory size of two large pages");
+    assert_eq!(shm_struct.page_size, LARGE_PAGE, "Page size should be recorded");
+    assert!([BACKING_SMALL_PAGES, BACKING_HUGETLB, BACKING_TRANSPARENT].contains(&shm_struct.backing));
+    // Whatever backs it, a large page region must sit on a large page boundary
+    assert_eq!(shm_struct.shared_buffer as u64 % LARGE_PAGE, 0, "Shared buffer should be 2 MiB aligned");
+
+    unsafe {
+        let last = (shm_struct.shared_buffer as *mut u8).add((2 * LARGE_PAGE - 1) as usize);
+        *last = 7;
+        assert_eq!(*last, 7, "Able to write to the end of the region");
+    }
+}
+
 #[test]
 fn test_add_shared_memory() {
     let mut loader = Loader::new();
@@ -148,3 +175,324 @@ fn test_channel_creation() {
         "Channel mapping is unidirectional"
     );
 }
+
+#[test]
+fn test_channel_connection() {
+    let mut loader = Loader::new();
+    let p1 = loader.create_process("client", 0x1000);
+    let p2 = loader.create_process("server", 0x1000);
+
+    loader.connect_channel("client", 1, "server", 2);
+
+    assert_eq!(loader.get_channel_target("client", 1), Some(p2), "Channel 1 should map client → server");
+    assert_eq!(loader.get_channel_target("server", 2), Some(p1), "Channel 2 should map server → client");
+    assert_eq!(loader.get_channel_target("client", 2), None, "Each end should only know its own id");
+}
+
+#[test]
+fn test_futex_ppc_transport() {
+    let mut loader = Loader::new();
+    loader.create_process("client", 0x1000);
+    let server = loader.create_process("server", 0x1000);
+
+    loader.create_channel("client", "server", 1);
+    loader.create_channel("server", "client", 2);
+
+    let server_ptr = server as *const Process;
+    assert!(unsafe { !(*server_ptr).control.is_null() }, "Control block should be mapped");
+    assert_eq!(unsafe { (*server_ptr).num_fast_slots }, 0, "Channels should default to the pipe transport");
+
+    loader.set_ppc_transport("client", 1, PpcTransport::Futex);
+    assert_eq!(unsafe { (*server_ptr).num_fast_slots }, 1, "Futex channel should take a call slot in the receiver");
+
+    loader.set_ppc_transport("client", 1, PpcTransport::Futex);
+    assert_eq!(unsafe { (*server_ptr).num_fast_slots }, 1, "Selecting the same transport twice should not take another slot");
+
+    assert_eq!(loader.get_channel_target("client", 1), Some(server), "Transport should not change the channel target");
+}
+
+#[test]
+fn test_channel_ipc_buffer() {
+    let mut loader = Loader::new();
+    let client = loader.create_process("client", 0x1000);
+    let server = loader.create_process("server", 0x1000);
+
+    loader.connect_channel("client", 1, "server", 2);
+
+    let (client_ptr, server_ptr) = (client as *const Process, server as *const Process);
+    unsafe {
+        assert_eq!((*client_ptr).mrs, (*client_ptr).ipc_buffer, "Message registers should start in the process's own IPC buffer");
+        assert!(!(*server_ptr).call_buffers.is_null(), "Every process should have IPC buffers for incoming calls");
+        assert_ne!((*server_ptr).call_buffers as *mut c_void, (*server_ptr).ipc_buffer,
+                   "Incoming calls should not share the receiver's own IPC buffer");
+    }
+
+    assert_eq!(loader.get_channel_shared("client", 1), Some(false), "Calls should copy their message registers by default");
+    assert_eq!(loader.get_channel_shared("server", 2), Some(false), "Calls should copy their message registers by default");
+    assert_eq!(loader.get_channel_shared("client", 2), None, "Each end should only know its own id");
+
+    // Either end asking is enough, as both ends call through the same buffers
+    loader.set_channel_ipc_buffer("client", 1);
+    assert_eq!(loader.get_channel_shared("client", 1), Some(true), "The end that asked should use the IPC buffer in place");
+    assert_eq!(loader.get_channel_shared("server", 2), Some(true), "The other end should use the IPC buffer in place");
+}
+
+#[test]
+fn test_priority() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("driver", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert_eq!(unsafe { (*proc_ptr).priority }, -1, "Priority should be unset by default");
+    assert_eq!(loader.processes["driver"].priority, None);
+
+    loader.set_priority("driver", 200);
+    assert_eq!(unsafe { (*proc_ptr).priority }, 200, "Priority should be stored for the child");
+    assert_eq!(loader.processes["driver"].priority, Some(200));
+}
+
+#[test]
+fn test_poll() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("driver", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert_eq!(unsafe { (*proc_ptr).poll_ns }, 0, "Processes should always block by default");
+
+    loader.set_poll("driver", 50);
+    assert_eq!(unsafe { (*proc_ptr).poll_ns }, 50_000, "Poll window should be stored in nanoseconds");
+}
+
+#[test]
+fn test_event_loop() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("driver", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert_eq!(unsafe { (*proc_ptr).event_loop }, EVENT_LOOP_EPOLL, "Processes should use epoll by default");
+
+    loader.set_event_loop("driver", EVENT_LOOP_IO_URING_SQPOLL);
+    assert_eq!(unsafe { (*proc_ptr).event_loop }, EVENT_LOOP_IO_URING_SQPOLL, "Event loop should be stored for the child");
+}
+
+#[test]
+fn test_deferred_notify() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("broadcaster", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert_eq!(unsafe { (*proc_ptr).defer_notify }, 0, "Notifications should be sent straight away by default");
+
+    loader.set_deferred_notify("broadcaster");
+    assert_eq!(unsafe { (*proc_ptr).defer_notify }, 1, "Notifications should be deferred once asked for");
+    assert_eq!(unsafe { (*proc_ptr).deferred_notify }, 0, "Nothing should be deferred before the process has run");
+}
+
+#[test]
+fn test_notification_group() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("broadcaster", 0x1000);
+    let proc_ptr = proc as *const Process;
+    let sub1 = loader.create_process("sub1", 0x1000);
+    let sub2 = loader.create_process("sub2", 0x1000);
+    assert!(unsafe { (*proc_ptr).groups.iter().all(|g| g.is_null()) }, "Processes should have no groups by default");
+
+    loader.add_group_member("broadcaster", 3, "sub1", 0);
+    loader.add_group_member("broadcaster", 3, "sub2", 5);
+    loader.add_group_member("broadcaster", 3, "sub2", 6);
+    let group = unsafe { (*proc_ptr).groups[3] } as *const NotificationGroup;
+    assert!(!group.is_null(), "The group should exist once it has members");
+    // A domain in the group under several ids is a single member
+    let members = unsafe { std::slice::from_raw_parts((*group).members, (*group).num_members as usize) };
+    assert_eq!(members.len(), 2, "The group should have one member per domain");
+    assert_eq!((members[0].receiver, members[0].bits), (sub1, 1 << 0), "sub1 should be notified on id 0");
+    assert_eq!((members[1].receiver, members[1].bits), (sub2, 1 << 5 | 1 << 6), "sub2 should be notified on ids 5 and 6");
+    assert_eq!(unsafe { (*(sub2 as *const Process)).group_ids }, 1 << 5 | 1 << 6, "Group ids should be reserved in the member");
+}
+
+#[test]
+fn test_console() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("logger", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert!(!unsafe { (*proc_ptr).console }.is_null(), "Every process should get a console ring");
+
+    // Write as the process would, with nothing draining the ring
+    let ring = unsafe { (*proc_ptr).console } as *const ConsoleRing;
+    let line = std::ffi::CString::new(format!("{}\n", "x".repeat(99))).unwrap();
+    unsafe { proc_global = proc; }
+    for _ in 0..1000 {
+        unsafe { microkit_dbg_puts(line.as_ptr()); }
+    }
+    unsafe { proc_global = std::ptr::null_mut(); }
+
+    // Each line takes its 100 bytes and the 8 byte timestamp in front of it
+    let fitting = (CONSOLE_RING_BYTES / 108) as u64;
+    assert_eq!(unsafe { (*ring).head }, fitting * 108, "Lines should be written until the ring is full");
+    assert_eq!(unsafe { (*ring).dropped }, (1000 - fitting) * 100, "Lines that do not fit should be dropped and counted whole");
+    assert_eq!(unsafe { (*ring).line_open }, 0, "A dropped line should not leave a line open");
+}
+
+#[test]
+fn test_preload_images() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("replica", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert!(unsafe { (*proc_ptr).image }.is_null(), "Processes should open their own image by default");
+
+    let replica = loader.create_process("replica_2", 0x1000) as *const Process;
+    let other = loader.create_process("other", 0x1000) as *const Process;
+    loader.set_process_image("replica", "libm.so.6".to_string());
+    loader.set_process_image("replica_2", "libm.so.6".to_string());
+    loader.set_process_image("other", "libz.so.1".to_string());
+    loader.set_preload_images();
+    loader.preload_images();
+
+    let image = unsafe { (*proc_ptr).image };
+    assert!(!image.is_null(), "Preloading should open the image before the process runs");
+    assert_eq!(unsafe { (*replica).image }, image, "Processes running the same image should share one preloaded handle");
+    assert_ne!(unsafe { (*other).image }, image, "Processes running different images should not share a handle");
+}
+
+#[test]
+fn test_budget() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("worker", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert_eq!(unsafe { (*proc_ptr).budget.period_ns }, 0, "Processes should have no budget by default");
+
+    loader.set_budget("worker", 1000, 1000);
+    assert_eq!(unsafe { (*proc_ptr).budget.period_ns }, 0, "A budget covering the whole period is not enforced");
+
+    loader.set_budget("worker", 2000, 10000);
+    let budget = unsafe { &(*proc_ptr).budget };
+    assert_eq!(budget.budget_ns, 2_000_000, "Budget should be stored in nanoseconds");
+    assert_eq!(budget.period_ns, 10_000_000, "Period should be stored in nanoseconds");
+    assert_eq!(budget.overruns, 0, "No overruns before the process has run");
+
+    loader.set_budget("worker", 3000, 10000);
+    assert_eq!(unsafe { (*proc_ptr).budget.budget_ns }, 3_000_000, "A later budget should replace the earlier one");
+
+    loader.set_budget("worker", 1000, 1000);
+    let budget = unsafe { &(*proc_ptr).budget };
+    assert_eq!((budget.budget_ns, budget.period_ns), (0, 0), "A budget covering the whole period should clear an earlier one");
+}
+
+#[test]
+fn test_map_shared_memory() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("reader", 0x1000);
+    loader.create_shared_memory("table", 0x2000);
+    loader.map_shared_memory("reader", "table", 0x5000000, libc::PROT_READ, None);
+
+    let node = unsafe { &*(*(proc as *const Process)).shared_memory };
+    assert_eq!(node.vaddr as u64, 0x5000000, "The map's vaddr should be kept for the child");
+    assert_eq!(node.prot, libc::PROT_READ, "The map's perms should be kept for the child");
+    assert!(node._varname.is_null(), "setvar_vaddr is optional");
+    assert!(node.mapped.is_null(), "Regions are only mapped by the child");
+
+    let shm = unsafe { &*(node.shm as *const SharedMemory) };
+    assert!(shm.fd >= 0, "Regions should be held by a memfd that children can map");
+}
+
+#[test]
+fn test_prefault() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("driver", 0x2000);
+    loader.set_memory_policy("driver", MEMORY_PREFAULT);
+    let proc_ptr = proc as *const Process;
+    assert_eq!(unsafe { (*proc_ptr).memory_policy }, MEMORY_PREFAULT, "Policy should be stored for the child");
+    assert_eq!(unsafe { (*proc_ptr).stack_size }, 0x2000, "Stack size should be kept for prefaulting");
+
+    let pages = 8;
+    loader.create_shared_memory("rings", pages * 0x1000);
+    loader.set_shared_memory_policy("rings", MEMORY_PREFAULT);
+    let shm = unsafe { &*(loader.get_shared_memory_handle("rings").unwrap() as *const SharedMemory) };
+    assert_eq!(shm.memory_policy, MEMORY_PREFAULT);
+
+    let mut resident = vec![0u8; pages as usize];
+    let result = unsafe { libc::mincore(shm.shared_buffer, (pages * 0x1000) as usize, resident.as_mut_ptr()) };
+    assert_eq!(result, 0, "mincore should succeed");
+    assert!(resident.iter().all(|page| page & 1 == 1), "Every page of a prefaulted region should be resident");
+}
+
+#[test]
+fn test_tracing() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("traced", 0x1000);
+    assert!(unsafe { (*(proc as *const Process)).trace.is_null() }, "Tracing should be off by default");
+
+    let path = std::env::temp_dir().join(format!("loader_test_trace_{}.json", std::process::id()));
+    loader.enable_tracing(path.to_str().unwrap());
+    assert!(unsafe { !(*(proc as *const Process)).trace.is_null() }, "Traced processes should get a ring");
+
+    // Nothing has run, so stopping only finishes the trace
+    loader.stop_all_processes();
+    let trace = std::fs::read_to_string(&path).unwrap();
+    std::fs::remove_file(&path).unwrap();
+    assert!(trace.starts_with("{\"displayTimeUnit\""), "Trace should be a Chrome JSON object");
+    assert!(trace.trim_end().ends_with("]}"), "Trace should be closed once the loader stops");
+}
+
+#[test]
+fn test_latency_stats() {
+    let mut loader = Loader::new();
+    let client = loader.create_process("client", 0x1000);
+    let server = loader.create_process("server", 0x1000);
+    loader.connect_channel("client", 1, "server", 4);
+    assert!(unsafe { (*(client as *const Process)).latency.is_null() }, "Histograms should be off by default");
+
+    loader.enable_latency_stats();
+    // The histograms of a process start with one per channel id for calls, then one per channel id for notifications
+    let histograms = |process: ProcessHandle| unsafe { &*((*(process as *const Process)).latency as *const [*mut c_void; 126]) };
+    assert!(!histograms(client)[1].is_null(), "The client should time the calls it makes on channel 1");
+    assert!(!histograms(client)[63 + 1].is_null(), "The client should time notifications arriving on channel 1");
+    assert!(!histograms(server)[4].is_null(), "The server should time the calls it makes on channel 4");
+    assert!(histograms(server)[1].is_null(), "Channel ids the server does not have should have no histogram");
+}
+
+#[test]
+fn test_affinity() {
+    let mut loader = Loader::new();
+    let proc = loader.create_process("driver", 0x1000);
+    let proc_ptr = proc as *const Process;
+    assert!(unsafe { (*proc_ptr).affinity.is_null() }, "Processes should be unpinned by default");
+
+    loader.set_affinity("driver", vec![0]);
+    assert!(unsafe { !(*proc_ptr).affinity.is_null() }, "Affinity should be stored for the child");
+    assert!(unsafe { (*proc_ptr).affinity_size } > 0, "Affinity set should have a size");
+    assert_eq!(loader.processes["driver"].cpus, vec![0]);
+}
+
+#[test]
+fn test_cpu_list_parsing() {
+    assert_eq!(parse_cpu_list("0-3,6").unwrap(), vec![0, 1, 2, 3, 6]);
+    assert_eq!(parse_cpu_list("5, 1,1\n").unwrap(), vec![1, 5], "Lists should be sorted and deduplicated");
+    assert!(parse_cpu_list("3-1").is_err(), "Backwards ranges should be rejected");
+    assert!(parse_cpu_list("x").is_err(), "Non-numeric CPUs should be rejected");
+    assert!(parse_cpu_list("").is_err(), "Empty lists should be rejected");
+}
+
+#[test]
+fn test_placement() {
+    // Two L2 groups of two CPUs each, listed out of order
+    let cpus = vec![
+        Cpu { id: 2, core: 2, l2: 2, l3: 0 },
+        Cpu { id: 0, core: 0, l2: 0, l3: 0 },
+        Cpu { id: 3, core: 3, l2: 2, l3: 0 },
+        Cpu { id: 1, core: 1, l2: 0, l3: 0 },
+    ];
+    let domains: Vec<String> = ["a", "b", "c", "d"].iter().map(|s| s.to_string()).collect();
+    let link = |x: &str, y: &str| (x.to_string(), y.to_string());
+    let links = vec![link("a", "c"), link("a", "c"), link("b", "d"), link("b", "d"), link("c", "b")];
+
+    let placement = place_domains(&domains, &links, &cpus);
+    assert_eq!(placement.len(), 4, "Every domain should be placed");
+    let cpu_of = |d: &str| placement.iter().find(|(name, _)| name == d).unwrap().1;
+    let l2_of = |d: &str| cpus.iter().find(|cpu| cpu.id == cpu_of(d)).unwrap().l2;
+
+    assert_eq!(l2_of("a"), l2_of("c"), "a and c should share an L2");
+    assert_eq!(l2_of("b"), l2_of("d"), "b and d should share an L2");
+    let mut used: Vec<u32> = placement.iter().map(|(_, cpu)| *cpu).collect();
+    used.sort();
+    assert_eq!(used, vec![0, 1, 2, 3], "With enough CPUs each domain should get its own");
+
+    let packed = place_domains(&domains, &links, &cpus[..1]);
+    assert!(packed.iter().all(|(_, cpu)| *cpu == 2), "A single CPU should take every domain");
+}